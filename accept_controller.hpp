@@ -0,0 +1,128 @@
+#ifndef ACCEPT_CONTROLLER_HPP
+#define ACCEPT_CONTROLLER_HPP
+
+#include <boost/system/error_code.hpp>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstddef>
+#include <mutex>
+
+// What an accept loop does when accept() fails or the server is full, shared by a server's
+// acceptors and safe to use from several threads.
+//
+// A failed accept backs off: the loop waits failed()'s delay before accepting again, starting
+// at FIRST_BACKOFF_MS and doubling up to MAX_BACKOFF_MS while failures continue; the next
+// accepted connection resets it. Retrying straight away only makes sense when the error went
+// away by itself, and most (ENOBUFS, ENOMEM, running out of descriptors) don't.
+//
+// Running out of descriptors (EMFILE, ENFILE) needs more than waiting: the connection accept()
+// could not take stays at the head of the backlog, the listener stays readable, and its client
+// hangs until it gives up. The controller keeps a spare descriptor open for this. It releases
+// it, accepts that connection and closes it at once, so the client sees its connection closed,
+// then takes the spare back.
+//
+// With maxConnections, admitting() turns false once that many connections are open; the loop
+// stops accepting, leaving newcomers in the kernel's backlog, until connectionClosed().
+class AcceptController {
+public:
+  enum {
+    FIRST_BACKOFF_MS = 10,
+    MAX_BACKOFF_MS = 1000,
+    ADMISSION_RETRY_MS = 50
+  };
+
+  // maxConnections 0: no limit.
+  explicit AcceptController(size_t maxConnections) :
+    _maxConnections(maxConnections),
+    _connections(0),
+    _backoffMs(0),
+    _shed(0),
+    _reserveFd(openReserve()) { }
+
+  ~AcceptController() {
+    if (_reserveFd >= 0) {
+      close(_reserveFd);
+    }
+  }
+
+  AcceptController(const AcceptController&) = delete;
+  AcceptController& operator=(const AcceptController&) = delete;
+
+  bool admitting() const {
+    return _maxConnections == 0 || _connections.load() < _maxConnections;
+  }
+
+  void connectionOpened() {
+    ++_connections;
+    _backoffMs = 0;
+  }
+
+  void connectionClosed() {
+    --_connections;
+  }
+
+  size_t maxConnections() const {
+    return _maxConnections;
+  }
+
+  // After accept() on listenFd failed with error: sheds the pending connection if descriptors
+  // ran out, and returns how long to wait before accepting again.
+  std::chrono::milliseconds failed(const boost::system::error_code& error, int listenFd) {
+    if (error.category() == boost::system::system_category() &&
+	(error.value() == EMFILE || error.value() == ENFILE)) {
+      shedPending(listenFd);
+    }
+    int backoff = _backoffMs.load();
+    int next;
+    do {
+      next = backoff == 0 ? FIRST_BACKOFF_MS : std::min(2 * backoff, int(MAX_BACKOFF_MS));
+    } while (! _backoffMs.compare_exchange_weak(backoff, next));
+    return std::chrono::milliseconds(next);
+  }
+
+  // Connections accepted only to be closed because descriptors ran out.
+  uint64_t shed() const {
+    return _shed;
+  }
+
+private:
+  static int openReserve() {
+    return open("/dev/null", O_RDONLY | O_CLOEXEC);
+  }
+
+  // Only takes a connection that is already waiting: a blocking listener must not block here.
+  void shedPending(int listenFd) {
+    std::lock_guard<std::mutex> guard(_reserveMutex);
+    if (_reserveFd >= 0) {
+      close(_reserveFd);
+      _reserveFd = -1;
+    }
+    pollfd pfd = { listenFd, POLLIN, 0 };
+    if (poll(&pfd, 1, 0) > 0) {
+      int fd = accept4(listenFd, nullptr, nullptr, SOCK_CLOEXEC);
+      if (fd >= 0) {
+	close(fd);
+	++_shed;
+      }
+    }
+    // Fails while the other descriptors are still in use; the next failure tries again.
+    _reserveFd = openReserve();
+  }
+
+  const size_t _maxConnections;
+  std::atomic<size_t> _connections;
+  std::atomic<int> _backoffMs;
+  std::atomic<uint64_t> _shed;
+  std::mutex _reserveMutex;
+  int _reserveFd;
+};
+
+#endif
@@ -0,0 +1,117 @@
+#ifndef ADAPTIVE_WAIT_HPP
+#define ADAPTIVE_WAIT_HPP
+
+#include "tsc_clock.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+// Spin-then-park wait for a single consumer thread. Parking on a condition variable costs a
+// futex sleep and wakeup plus the scheduler latency of getting back on a CPU; when items come
+// in faster than that, spinning on an atomic for a moment is cheaper. The spin time is learned
+// from the gaps between the consumer starting to wait and the next notify(): their running
+// average, doubled, is spun for as long as it stays within maxSpinNs, otherwise the consumer
+// parks straight away. Parked waits keep feeding the average with the gap until notify(), not
+// the wakeup time, so a consumer whose producers speed up starts spinning again.
+//
+// The mutex belongs to the caller: wait() takes a lock on it like condition_variable::wait(),
+// and notify() must be called with it held, after making the condition true.
+class AdaptiveWait {
+public:
+  enum : uint64_t {
+    MIN_SPIN_NS = 2000
+  };
+
+  // maxSpinNs 0 makes every wait park, like a plain condition variable. So does a single CPU,
+  // where the producer can't run while the consumer spins.
+  explicit AdaptiveWait(uint64_t maxSpinNs) :
+    _maxSpinNs(std::thread::hardware_concurrency() > 1 ? maxSpinNs : 0),
+    _averageGapNs(0),
+    _epoch(0),
+    _notifiedNs(0),
+    _parked(false),
+    _spins(0),
+    _parks(0) { }
+
+  void notify() {
+    _notifiedNs = TscClock::instance().now();
+    _epoch.fetch_add(1, std::memory_order_release);
+    if (_parked) {
+      _condition.notify_one();
+    }
+  }
+
+  // Returns the nanoseconds between the notify() that ended the wait and the consumer
+  // running again, or 0 if ready() held from the start.
+  template <class Ready>
+  uint64_t wait(std::unique_lock<std::mutex>& lock, Ready ready) {
+    if (ready()) {
+      learn(0);
+      return 0;
+    }
+    TscClock& clock = TscClock::instance();
+    uint64_t start = clock.now();
+    uint64_t budget = spinBudget();
+    if (budget) {
+      unsigned epoch = _epoch.load(std::memory_order_acquire);
+      lock.unlock();
+      while (_epoch.load(std::memory_order_acquire) == epoch && clock.now() - start < budget) {
+	cpuRelax();
+      }
+      lock.lock();
+    }
+    if (budget && ready()) {
+      ++_spins;
+    }
+    else {
+      _parked = true;
+      _condition.wait(lock, ready);
+      _parked = false;
+      ++_parks;
+    }
+    uint64_t notified = _notifiedNs;
+    learn(notified > start ? notified - start : 0);
+    uint64_t end = clock.now();
+    return end > notified ? end - notified : 0;
+  }
+
+  // Waits that ended while spinning and waits that parked, since construction.
+  uint64_t spins() const {
+    return _spins;
+  }
+
+  uint64_t parks() const {
+    return _parks;
+  }
+
+private:
+  uint64_t spinBudget() const {
+    uint64_t budget = std::max<uint64_t>(2 * _averageGapNs, MIN_SPIN_NS);
+    return budget <= _maxSpinNs ? budget : 0;
+  }
+
+  void learn(uint64_t gapNs) {
+    _averageGapNs += (static_cast<int64_t>(gapNs) - _averageGapNs) / 8;
+  }
+
+  static void cpuRelax() {
+#if defined(__x86_64__) || defined(__i386__)
+    _mm_pause();
+#endif
+  }
+
+  const uint64_t _maxSpinNs;
+  int64_t _averageGapNs;  // consumer only
+  std::atomic<unsigned> _epoch;
+  uint64_t _notifiedNs;  // under the caller's mutex
+  bool _parked;
+  std::condition_variable _condition;
+  uint64_t _spins;
+  uint64_t _parks;
+};
+
+#endif
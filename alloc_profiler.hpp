@@ -0,0 +1,199 @@
+#ifndef ALLOC_PROFILER_HPP
+#define ALLOC_PROFILER_HPP
+
+#include <ostream>
+
+// Heap allocation accounting, compiled in with -DCHAT_ALLOC_PROFILE and free otherwise.
+//
+// When enabled, this header replaces the global operator new/delete, so it must be included
+// by exactly one translation unit of the program (every server is a single one). Each
+// allocation is charged to the calling thread and to the innermost AllocScope active on it;
+// reportAllocations() prints the totals per scope, allocations per chat message and the
+// busiest threads. If CHAT_ALLOC_BUDGET is set in the environment, the report also checks
+// allocations per message against it and returns false when it's exceeded.
+enum class AllocTag {
+  OTHER,
+  READ,
+  PARSE,
+  FORMAT,
+  BROADCAST,
+  WRITE,
+  COUNT
+};
+
+#ifdef CHAT_ALLOC_PROFILE
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <iomanip>
+#include <new>
+#include <utility>
+#include <vector>
+
+namespace alloc_profiler {
+
+enum {
+  MAX_THREADS = 1024  // later threads share the last slot
+};
+
+struct Counters {
+  std::atomic<uint64_t> allocations[static_cast<int>(AllocTag::COUNT)];
+  std::atomic<uint64_t> bytes[static_cast<int>(AllocTag::COUNT)];
+};
+
+// Zero-initialized statics and trivial thread_locals only: operator new may run before
+// anything else is constructed, and must never allocate itself.
+static Counters threadCounters[MAX_THREADS];
+static std::atomic<int> threadsSeen(0);
+static std::atomic<uint64_t> messages(0);
+static thread_local int threadSlot = -1;
+static thread_local AllocTag currentTag = AllocTag::OTHER;
+
+inline void charge(std::size_t size) {
+  if (threadSlot < 0) {
+    threadSlot = std::min<int>(threadsSeen.fetch_add(1, std::memory_order_relaxed), MAX_THREADS - 1);
+  }
+  Counters& counters = threadCounters[threadSlot];
+  int tag = static_cast<int>(currentTag);
+  counters.allocations[tag].fetch_add(1, std::memory_order_relaxed);
+  counters.bytes[tag].fetch_add(size, std::memory_order_relaxed);
+}
+
+inline void* allocate(std::size_t size) {
+  charge(size);
+  return std::malloc(size ? size : 1);
+}
+
+}
+
+void* operator new(std::size_t size) {
+  void* ptr = alloc_profiler::allocate(size);
+  if (! ptr) {
+    throw std::bad_alloc();
+  }
+  return ptr;
+}
+
+void* operator new[](std::size_t size) {
+  return operator new(size);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept {
+  return alloc_profiler::allocate(size);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept {
+  return alloc_profiler::allocate(size);
+}
+
+// Out of line, so the compiler doesn't pair malloc() seen through operator new with free().
+__attribute__((noinline)) void operator delete(void* ptr) noexcept {
+  std::free(ptr);
+}
+
+void operator delete[](void* ptr) noexcept {
+  operator delete(ptr);
+}
+
+void operator delete(void* ptr, std::size_t) noexcept {
+  operator delete(ptr);
+}
+
+void operator delete[](void* ptr, std::size_t) noexcept {
+  operator delete(ptr);
+}
+
+// Charges allocations made while it's alive to 'tag'; scopes nest.
+class AllocScope {
+public:
+  explicit AllocScope(AllocTag tag) :
+    _previous(alloc_profiler::currentTag) {
+    alloc_profiler::currentTag = tag;
+  }
+
+  ~AllocScope() {
+    alloc_profiler::currentTag = _previous;
+  }
+
+  AllocScope(const AllocScope&) = delete;
+  AllocScope& operator=(const AllocScope&) = delete;
+
+private:
+  AllocTag _previous;
+};
+
+inline void countAllocProfiledMessage() {
+  alloc_profiler::messages.fetch_add(1, std::memory_order_relaxed);
+}
+
+inline bool reportAllocations(std::ostream& stream) {
+  using namespace alloc_profiler;
+  static const char* const names[] = { "other", "read", "parse", "format", "broadcast", "write" };
+  const int tags = static_cast<int>(AllocTag::COUNT);
+  int threads = std::min<int>(threadsSeen.load(), MAX_THREADS);
+
+  uint64_t allocations[tags] = {};
+  uint64_t bytes[tags] = {};
+  std::vector<std::pair<uint64_t, int> > perThread;
+  for (int thread = 0; thread < threads; ++thread) {
+    uint64_t threadAllocations = 0;
+    for (int tag = 0; tag < tags; ++tag) {
+      allocations[tag] += threadCounters[thread].allocations[tag].load();
+      bytes[tag] += threadCounters[thread].bytes[tag].load();
+      threadAllocations += threadCounters[thread].allocations[tag].load();
+    }
+    perThread.emplace_back(threadAllocations, thread);
+  }
+
+  uint64_t messageCount = messages.load();
+  uint64_t messageAllocations = 0;
+  stream << "allocations by scope (" << messageCount << " messages):\n";
+  for (int tag = 0; tag < tags; ++tag) {
+    if (tag != static_cast<int>(AllocTag::OTHER)) {
+      messageAllocations += allocations[tag];
+    }
+    stream << "  " << std::left << std::setw(10) << names[tag] << std::right
+	   << std::setw(12) << allocations[tag] << " allocs " << std::setw(14) << bytes[tag] << " bytes";
+    if (messageCount) {
+      stream << "  " << std::fixed << std::setprecision(2)
+	     << double(allocations[tag]) / messageCount << " per message";
+    }
+    stream << '\n';
+  }
+
+  std::sort(perThread.rbegin(), perThread.rend());
+  stream << "busiest of " << threads << " threads:\n";
+  for (size_t i = 0; i < perThread.size() && i < 10; ++i) {
+    stream << "  thread " << std::setw(4) << perThread[i].second
+	   << std::setw(12) << perThread[i].first << " allocs\n";
+  }
+
+  const char* budget = std::getenv("CHAT_ALLOC_BUDGET");
+  if (budget && messageCount) {
+    double perMessage = double(messageAllocations) / messageCount;
+    double limit = std::atof(budget);
+    stream << "allocations per message " << perMessage << ", budget " << limit
+	   << (perMessage > limit ? ": OVER BUDGET\n" : ": ok\n");
+    return perMessage <= limit;
+  }
+  return true;
+}
+
+#else
+
+class AllocScope {
+public:
+  explicit AllocScope(AllocTag) { }
+};
+
+inline void countAllocProfiledMessage() { }
+
+inline bool reportAllocations(std::ostream&) {
+  return true;
+}
+
+#endif
+
+#endif
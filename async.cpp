@@ -1,9 +1,22 @@
 #include <boost/asio.hpp>
-#include <boost/date_time.hpp>
 #include <boost/lexical_cast.hpp>
 
+#include "accept_controller.hpp"
+#include "alloc_profiler.hpp"
+#include "chat_index.hpp"
+#include "chunked_fan_out.hpp"
+#include "flood_filter.hpp"
+#include "mailbox_store.hpp"
+#include "mention_matcher.hpp"
+#include "presence_batcher.hpp"
+#include "server_options.hpp"
+#include "traffic_capture.hpp"
+#include "tsc_clock.hpp"
+#include "unix_listener.hpp"
+
 #include <array>
 #include <deque>
+#include <iostream>
 #include <map>
 
 #include <functional>
@@ -21,9 +34,12 @@ public:
     _server(server),
     _socket(ioService),
     _nameValid(false),
-    _sendingAllowed(false) { }
+    _sendingAllowed(false),
+    _started(false),
+    _captureId(0) { }
+  ~ClientSession();
 
-  tcp::socket &socket() {
+  StreamSocket &socket() {
     return _socket;
   }
 
@@ -38,6 +54,8 @@ public:
   }
 
   void start() {
+    _started = true;
+    record(CaptureEvent::CONNECT);
     askForUserName();
   }
  
@@ -51,6 +69,7 @@ private:
   void messageOutputFinished();
   void handleInputLine(const std::string& line);
   bool parseLine(const std::string& line);
+  void record(CaptureEvent event, const std::string& payload = std::string());
 
   void asyncReadLine(void (ClientSession::*handler)(const std::string& line));
   template <class Buffer>
@@ -62,13 +81,16 @@ private:
   void terminate();
 
   ChatServer& _server;
-  tcp::socket _socket;
+  StreamSocket _socket;
   std::string _name;
   bool _nameValid;
   boost::asio::streambuf _inputBuffer;
   std::string _outputBuffer;
   std::deque<std::shared_ptr<std::string> > _messages;
+  std::vector<std::shared_ptr<std::string> > _mail;
   bool _sendingAllowed;
+  bool _started;
+  uint32_t _captureId;
 
   friend class ReadHandler;
   friend class WriteHandler;
@@ -93,23 +115,70 @@ typedef std::map<const std::string*, std::shared_ptr<ClientSession>, PtrLess<std
 
 class ChatServer {
 public:
-  ChatServer(int port) :
-    _acceptor(_ioService, tcp::endpoint(tcp::v4(), port)) { }
+  ChatServer(const ServerOptions& options) :
+    _options(options),
+    _recorder(options.recordPath.empty() ? nullptr : new TrafficRecorder(options.recordPath)),
+    _mailboxes(options.mailboxPath.empty() ? nullptr : new MailboxStore(options.mailboxPath)),
+    _floodFilter(options.floodLimit, std::chrono::seconds(options.floodWindowSec)),
+    _acceptController(options.maxConnections),
+    _acceptor(_ioService, tcp::endpoint(tcp::v4(), options.port)),
+    _unixAcceptor(_ioService),
+    _fanOut(_ioService, _namesToClients, options.fanOutThreshold, options.fanOutChunk),
+    _presenceTimer(_ioService) {
+    if (! options.unixPath.empty()) {
+      openUnixAcceptor(_unixAcceptor, options.unixPath);
+    }
+  }
 
   void run();
 
   bool setClientName(const std::shared_ptr<ClientSession>& client, const std::string& userName);
   void broadcast(ClientSession& client, const std::shared_ptr<std::string>& msg);
+  void notifyMentions(ClientSession& sender, const std::string& line);
+  void addToHistory(ClientSession& sender, const std::string& line,
+		    const std::shared_ptr<std::string>& msg);
+  bool admitLine(ClientSession& sender, const std::string& line);
+  void search(ClientSession& client, const std::string& query);
+  void sendPrivate(ClientSession& sender, const std::string& args);
+  std::vector<std::shared_ptr<std::string> > peekMail(const std::string& name);
+  void ackMail(const std::string& name, const std::vector<std::shared_ptr<std::string> >& mail);
   void removeClient(ClientSession& client);
+  void connectionClosed();
   void shutdown();
 
-private:
-  void startAccept();
-  void onAccept(std::shared_ptr<ClientSession> client, const boost::system::error_code& error);
+  // Null unless traffic capture was requested.
+  TrafficRecorder* recorder() {
+    return _recorder.get();
+  }
 
+private:
+  template <class Acceptor>
+  void startAccept(Acceptor& acceptor);
+  template <class Acceptor>
+  void onAccept(Acceptor& acceptor, std::shared_ptr<ClientSession> client,
+		const boost::system::error_code& error);
+  template <class Acceptor>
+  void retryAccept(Acceptor& acceptor, std::chrono::milliseconds delay);
+  template <class Acceptor>
+  void onAcceptRetry(Acceptor& acceptor, std::shared_ptr<boost::asio::steady_timer> timer,
+		     const boost::system::error_code& error);
+  void schedulePresenceFlush();
+  void flushPresence(const boost::system::error_code& error);
+
+  ServerOptions _options;
+  std::unique_ptr<TrafficRecorder> _recorder;
+  std::unique_ptr<MailboxStore> _mailboxes;
+  FloodFilter _floodFilter;
+  AcceptController _acceptController;  // before _ioService, whose queued sessions close into it
   boost::asio::io_service _ioService;
   tcp::acceptor _acceptor;
+  boost::asio::local::stream_protocol::acceptor _unixAcceptor;
   NamesToClientsMap _namesToClients;
+  ChunkedFanOut<ClientSession, NamesToClientsMap> _fanOut;
+  MentionMatcher _mentions;
+  ChatIndex _history;
+  PresenceBatcher _presence;
+  boost::asio::steady_timer _presenceTimer;
 };
 
 
@@ -130,6 +199,7 @@ public:
       _client->handleReadError(error);
       return;
     }
+    AllocScope readScope(AllocTag::READ);
     std::string line = _client->readLineFromClient();
     ((*_client).*_handler)(line);
   }
@@ -154,6 +224,7 @@ public:
       _client->handleWriteError(error);
       return;
     }
+    AllocScope writeScope(AllocTag::WRITE);
     ((*_client).*_handler)();
   }
 
@@ -172,10 +243,24 @@ void ClientSession::readUserName() {
   asyncReadLine(&ClientSession::handleUserName);
 }
 
+ClientSession::~ClientSession() {
+  record(CaptureEvent::DISCONNECT);
+  if (_started) {
+    _server.connectionClosed();
+  }
+}
+
 void ClientSession::handleUserName(const std::string& userName) {
+  record(CaptureEvent::NAME, userName);
   if (_server.setClientName(shared_from_this(), userName)) {
     _outputBuffer = "Welcome to the chat, " + userName + "!\n";
-    asyncWrite(boost::asio::buffer(_outputBuffer), &ClientSession::startReceivingAndSendingMessages);
+    // Messages left while the user was away go out in the same write as the greeting.
+    _mail = _server.peekMail(userName);
+    std::vector<boost::asio::const_buffer> buffers{ boost::asio::buffer(_outputBuffer) };
+    for (const auto& msg : _mail) {
+      buffers.push_back(boost::asio::buffer(*msg));
+    }
+    asyncWrite(buffers, &ClientSession::startReceivingAndSendingMessages);
   }
   else {
     _outputBuffer = "Name '" + userName + "' is already taken, invent another one.\n";
@@ -184,6 +269,8 @@ void ClientSession::handleUserName(const std::string& userName) {
 }
 
 void ClientSession::startReceivingAndSendingMessages() {
+  _server.ackMail(_name, _mail);
+  _mail.clear();
   _sendingAllowed = true;
   if (! _messages.empty()) {
     asyncWrite(boost::asio::buffer(*_messages.front()), &ClientSession::messageOutputFinished);
@@ -202,6 +289,8 @@ void ClientSession::handleInputLine(const std::string& line) {
 }
 
 bool ClientSession::parseLine(const std::string& line) {
+  AllocScope parseScope(AllocTag::PARSE);
+  record(CaptureEvent::LINE, line);
   if (line == "/quit") {
     return false;
   }
@@ -209,14 +298,51 @@ bool ClientSession::parseLine(const std::string& line) {
     _server.shutdown();
     return false;
   }
+  else if (line.compare(0, 5, "/msg ") == 0) {
+    _server.sendPrivate(*this, line.substr(5));
+    return true;
+  }
+  else if (line.compare(0, 8, "/search ") == 0) {
+    _server.search(*this, line.substr(8));
+    return true;
+  }
+  else if (! _server.admitLine(*this, line)) {
+    return true;
+  }
   else {
-    std::ostringstream stream;
-    stream << boost::posix_time::microsec_clock::local_time() << ' ' << _name << ": " << line << std::endl;
-    _server.broadcast(*this, std::make_shared<std::string>(stream.str()));
+    countAllocProfiledMessage();
+    std::shared_ptr<std::string> msg;
+    {
+      AllocScope formatScope(AllocTag::FORMAT);
+      msg = std::make_shared<std::string>();
+      msg->reserve(LOCAL_TIMESTAMP_SIZE + _name.size() + line.size() + 4);
+      appendLocalTimestamp(*msg, TscClock::instance().realtimeNow());
+      *msg += ' ';
+      *msg += _name;
+      *msg += ": ";
+      *msg += line;
+      *msg += '\n';
+    }
+    AllocScope broadcastScope(AllocTag::BROADCAST);
+    _server.broadcast(*this, msg);
+    _server.addToHistory(*this, line, msg);
+    _server.notifyMentions(*this, line);
     return true;
   }
 }
 
+void ClientSession::record(CaptureEvent event, const std::string& payload) {
+  TrafficRecorder* recorder = _server.recorder();
+  if (recorder) {
+    if (event == CaptureEvent::CONNECT) {
+      _captureId = recorder->newSession();
+    }
+    if (_captureId) {
+      recorder->record(event, _captureId, payload);
+    }
+  }
+}
+
 void ClientSession::messageOutputFinished() {
   assert(_sendingAllowed);
   assert(! _messages.empty());
@@ -267,26 +393,92 @@ void ClientSession::terminate() {
 }
 
 void ChatServer::run() {
-  startAccept();
-  _ioService.run();
+  if (! _options.cpus.empty()) {
+    pinCurrentThreadToCpu(_options.cpus.front());
+  }
+  startAccept(_acceptor);
+  if (_unixAcceptor.is_open()) {
+    startAccept(_unixAcceptor);
+  }
+  if (_options.presenceIntervalMs > 0) {
+    schedulePresenceFlush();
+  }
+  if (_options.spin) {
+    runSpinning(_ioService);
+  }
+  else {
+    _ioService.run();
+  }
+}
+
+void ChatServer::schedulePresenceFlush() {
+  _presenceTimer.expires_from_now(std::chrono::milliseconds(_options.presenceIntervalMs));
+  _presenceTimer.async_wait(std::bind(&ChatServer::flushPresence, this, _1));
 }
 
-void ChatServer::startAccept() {
+void ChatServer::flushPresence(const boost::system::error_code& error) {
+  if (error) {
+    return;
+  }
+  std::string summary = _presence.flush();
+  if (! summary.empty()) {
+    _fanOut.broadcastToAll(std::make_shared<std::string>(std::move(summary)));
+  }
+  schedulePresenceFlush();
+}
+
+template <class Acceptor>
+void ChatServer::startAccept(Acceptor& acceptor) {
+  if (! _acceptController.admitting()) {
+    retryAccept(acceptor, std::chrono::milliseconds(AcceptController::ADMISSION_RETRY_MS));
+    return;
+  }
   std::shared_ptr<ClientSession> client = std::make_shared<ClientSession>(*this, _ioService);
-  _acceptor.async_accept(client->socket(),
-			 std::bind(&ChatServer::onAccept, this, client, _1));
+  acceptor.async_accept(client->socket(),
+			std::bind(&ChatServer::onAccept<Acceptor>, this, std::ref(acceptor), client, _1));
 }
 
-void ChatServer::onAccept(std::shared_ptr<ClientSession> client,
+template <class Acceptor>
+void ChatServer::onAccept(Acceptor& acceptor, std::shared_ptr<ClientSession> client,
 			  const boost::system::error_code& error) {
   if (! error) {
+    if (_options.busyPollUsec > 0) {
+      enableBusyPoll(client->socket().native_handle(), _options.busyPollUsec);
+    }
+    _acceptController.connectionOpened();
     client->start();
+    if (! _acceptController.admitting()) {
+      std::cout << "Accepting paused at " << _acceptController.maxConnections()
+		<< " connections" << std::endl;
+    }
+  }
+  else if (error == boost::asio::error::operation_aborted) {
+    return;
   }
   else {
-    std::cout << "Accept error: " << error << std::endl;
+    auto delay = _acceptController.failed(error, acceptor.native_handle());
+    std::cout << "Accept error: " << error << ", retrying in " << delay.count() << " ms"
+	      << std::endl;
+    retryAccept(acceptor, delay);
+    return;
   }
 
-  startAccept();
+  startAccept(acceptor);
+}
+
+template <class Acceptor>
+void ChatServer::retryAccept(Acceptor& acceptor, std::chrono::milliseconds delay) {
+  auto timer = std::make_shared<boost::asio::steady_timer>(_ioService, delay);
+  timer->async_wait(std::bind(&ChatServer::onAcceptRetry<Acceptor>, this, std::ref(acceptor),
+			      timer, _1));
+}
+
+template <class Acceptor>
+void ChatServer::onAcceptRetry(Acceptor& acceptor, std::shared_ptr<boost::asio::steady_timer>,
+			       const boost::system::error_code& error) {
+  if (! error) {
+    startAccept(acceptor);
+  }
 }
 
 bool ChatServer::setClientName(const std::shared_ptr<ClientSession>& client,
@@ -294,8 +486,11 @@ bool ChatServer::setClientName(const std::shared_ptr<ClientSession>& client,
   NamesToClientsMap::iterator found = _namesToClients.find(&name);
   if (found == _namesToClients.end()) {
     client->setName(name);
-    auto res = _namesToClients.insert(std::make_pair(client->getName(), client));
-    assert(res.second);
+    _namesToClients.emplace(client->getName(), client);
+    _mentions.add(name);
+    if (_options.presenceIntervalMs > 0) {
+      _presence.joined(name);
+    }
     return true;
   }
   else {
@@ -304,16 +499,95 @@ bool ChatServer::setClientName(const std::shared_ptr<ClientSession>& client,
 }
 
 void ChatServer::broadcast(ClientSession& client, const std::shared_ptr<std::string>& msg) {
-  for (const auto& kvPair : _namesToClients) {
-    ClientSession* receiver = kvPair.second.get();
-    if (receiver!= &client) {
-      receiver->sendMessage(msg);
+  _fanOut.broadcast(client, msg);
+}
+
+void ChatServer::notifyMentions(ClientSession& sender, const std::string& line) {
+  std::vector<std::string> names;
+  _mentions.scan(line, names);
+  if (names.empty()) {
+    return;
+  }
+  auto msg = std::make_shared<std::string>("*** " + *sender.getName() + " mentioned you\n");
+  for (const auto& name : names) {
+    NamesToClientsMap::iterator found = _namesToClients.find(&name);
+    if (found != _namesToClients.end() && found->second.get() != &sender) {
+      _fanOut.sendTo(*found->second, msg);
     }
   }
 }
 
+bool ChatServer::admitLine(ClientSession& sender, const std::string& line) {
+  if (! _floodFilter.enabled() || _floodFilter.admit(line)) {
+    return true;
+  }
+  _fanOut.sendTo(sender, std::make_shared<std::string>("*** Repeated message dropped\n"));
+  return false;
+}
+
+void ChatServer::addToHistory(ClientSession& sender, const std::string& line,
+			      const std::shared_ptr<std::string>& msg) {
+  _history.add(msg, *sender.getName() + ' ' + line);
+}
+
+void ChatServer::search(ClientSession& client, const std::string& query) {
+  auto lines = _history.search(query, ChatIndex::MAX_RESULTS);
+  auto msg = std::make_shared<std::string>("*** " + boost::lexical_cast<std::string>(lines.size())
+					   + " matches for " + query + '\n');
+  for (const auto& line : lines) {
+    *msg += *line;
+  }
+  _fanOut.sendTo(client, msg);
+}
+
+void ChatServer::sendPrivate(ClientSession& sender, const std::string& args) {
+  size_t space = args.find(' ');
+  if (space == std::string::npos || space == 0) {
+    _fanOut.sendTo(sender, std::make_shared<std::string>("*** Usage: /msg <name> <text>\n"));
+    return;
+  }
+  std::string name = args.substr(0, space);
+  std::string text;
+  appendLocalTimestamp(text, TscClock::instance().realtimeNow());
+  text += ' ' + *sender.getName() + " -> " + name + ": " + args.substr(space + 1) + '\n';
+
+  NamesToClientsMap::iterator found = _namesToClients.find(&name);
+  if (found != _namesToClients.end()) {
+    _fanOut.sendTo(*found->second, std::make_shared<std::string>(text));
+  }
+  else if (_mailboxes) {
+    bool saved = _mailboxes->deposit(name, text);
+    _fanOut.sendTo(sender, std::make_shared<std::string>("*** " + name + " is offline, message " +
+							 (saved ? "saved\n" : "not saved\n")));
+  }
+  else {
+    _fanOut.sendTo(sender, std::make_shared<std::string>("*** " + name + " is not online\n"));
+  }
+}
+
+std::vector<std::shared_ptr<std::string> > ChatServer::peekMail(const std::string& name) {
+  return _mailboxes ? _mailboxes->peek(name) : std::vector<std::shared_ptr<std::string> >();
+}
+
+// Once the mail from peekMail() has been written to the client.
+void ChatServer::ackMail(const std::string& name,
+			 const std::vector<std::shared_ptr<std::string> >& mail) {
+  if (_mailboxes && ! mail.empty()) {
+    _mailboxes->ack(name, mail);
+  }
+}
+
 void ChatServer::removeClient(ClientSession& client) {
-  _namesToClients.erase(client.getName());
+  if (_namesToClients.erase(client.getName()) == 1) {
+    _mentions.remove(*client.getName());
+    if (_options.presenceIntervalMs > 0) {
+      _presence.left(*client.getName());
+    }
+  }
+}
+
+void ChatServer::connectionClosed() {
+  _acceptController.connectionClosed();
 }
 
 void ChatServer::shutdown() {
@@ -321,21 +595,30 @@ void ChatServer::shutdown() {
 }
 
 int main(int argc, char **argv) {
+  ServerOptions options;
   try {
-    if (argc < 2) {
-      std::cerr << "Usage: " << argv[0] << " <port>\n";
-      return 1;
-    }
-
-    boost::asio::io_service ioService;
+    options = parseServerOptions(argc, argv);
+  }
+  catch (std::exception &ex) {
+    std::cerr << ex.what() << std::endl;
+    printServerUsage(std::cerr, argv[0]);
+    return 1;
+  }
 
-    
-    ChatServer server(boost::lexical_cast<int>(argv[1]));
+  // Calibrating the clock busy-waits 20 ms: done here rather than by the first message.
+  TscClock::instance();
+  int status = 0;
+  try {
+    ChatServer server(options);
     server.run();
-    return 0;
   }
   catch (std::exception &ex) {
     std::cerr << "Main thread exception: " << ex.what() << std::endl;
-    return 1;
+    status = 1;
+  }
+  // After the server is gone, so its threads' allocations are all in.
+  if (! reportAllocations(std::cout)) {
+    status = 1;
   }
+  return status;
 }
@@ -0,0 +1,25 @@
+#!/bin/sh
+# Sweeps echo_server thread counts and reports latency (ping-pong) and throughput (stream)
+# for each, over loopback TCP and over a Unix domain socket.
+# Usage: bench_echo.sh [bin_dir] [port]
+BIN=${1:-.}
+PORT=${2:-7777}
+UNIX_PATH=@bench_echo_$PORT
+DURATION=${DURATION:-5}
+CONNECTIONS=${CONNECTIONS:-64}
+CLIENT_THREADS=${CLIENT_THREADS:-4}
+
+for THREADS in ${THREAD_COUNTS:-1 2 4 8}; do
+  "$BIN/echo_server" "$PORT" --threads "$THREADS" --unix "$UNIX_PATH" &
+  SERVER=$!
+  sleep 0.5
+  echo "=== echo_server --threads $THREADS"
+  for TARGET in "127.0.0.1 $PORT" "--unix $UNIX_PATH"; do
+    "$BIN/echo_client" $TARGET --mode pingpong --connections "$CONNECTIONS" \
+      --threads "$CLIENT_THREADS" --size 64 --duration "$DURATION"
+    "$BIN/echo_client" $TARGET --mode stream --connections "$CONNECTIONS" \
+      --threads "$CLIENT_THREADS" --size 16384 --duration "$DURATION"
+  done
+  kill "$SERVER"
+  wait "$SERVER" 2>/dev/null
+done
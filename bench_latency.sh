@@ -0,0 +1,28 @@
+#!/bin/sh
+# Compares echo_server's round-trip tail latency with and without the low-latency options:
+# CPU pinning, SO_BUSY_POLL and a spinning reactor, each alone and then all together. One
+# ping-pong run per mode, reported as p50, p99 and p99.9.
+# Usage: bench_latency.sh [bin_dir] [port]
+# Environment: DURATION, CONNECTIONS, SERVER_CPUS (for --cpus), BUSY_POLL (usec, for
+# --busy-poll), CLIENT_CPUS (pins echo_client in every mode; keep it apart from SERVER_CPUS)
+BIN=${1:-.}
+PORT=${2:-7779}
+DURATION=${DURATION:-5}
+CONNECTIONS=${CONNECTIONS:-1}
+SERVER_CPUS=${SERVER_CPUS:-0}
+BUSY_POLL=${BUSY_POLL:-50}
+
+printf "%-36s %10s %10s %10s\n" "echo_server options" "p50 us" "p99 us" "p99.9 us"
+for MODE in "" "--cpus $SERVER_CPUS" "--busy-poll $BUSY_POLL" --spin \
+	    "--cpus $SERVER_CPUS --busy-poll $BUSY_POLL --spin"; do
+  "$BIN/echo_server" "$PORT" $MODE >/dev/null &
+  SERVER=$!
+  sleep 0.5
+  "$BIN/echo_client" 127.0.0.1 "$PORT" --mode pingpong --connections "$CONNECTIONS" \
+    --size 64 --duration "$DURATION" ${CLIENT_CPUS:+--cpus "$CLIENT_CPUS"} |
+    awk -v mode="${MODE:-(none)}" '
+      $1 == "p50" { p50 = $2 } $1 == "p99" { p99 = $2 } $1 == "p99.9" { p999 = $2 }
+      END { printf "%-36s %10s %10s %10s\n", mode, p50, p99, p999 }'
+  kill "$SERVER"
+  wait "$SERVER" 2>/dev/null
+done
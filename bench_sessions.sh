@@ -0,0 +1,26 @@
+#!/bin/sh
+# Compares the threaded server's session modes - a reader and a writer thread per client
+# against one thread polling the socket and an eventfd - on the same replayed chat: replay
+# time, then the server's own report of peak session threads, memory and context switches.
+# Usage: bench_sessions.sh [bin_dir] [port]
+# Environment: SESSIONS (clients connected at once), LINES (chat lines replayed)
+BIN=${1:-.}
+PORT=${2:-7788}
+SESSIONS=${SESSIONS:-200}
+LINES=${LINES:-5000}
+CAPTURE=$(mktemp)
+REPORT=$(mktemp)
+
+# The capture ends in /shutdown, so the server exits and prints its report.
+"$BIN/replay" --generate "$CAPTURE" --sessions "$SESSIONS" --lines "$LINES" --shutdown
+
+for MODE in "" --poll-sessions; do
+  "$BIN/threaded" "$PORT" $MODE --presence-interval 0 >"$REPORT" 2>&1 &
+  SERVER=$!
+  sleep 0.5
+  echo "=== threaded ${MODE:-(reader and writer threads)}"
+  "$BIN/replay" "$CAPTURE" 127.0.0.1 "$PORT" --speed 0 | head -1
+  wait "$SERVER"
+  grep -a "peak session threads" "$REPORT"
+done
+rm -f "$CAPTURE" "$REPORT"
@@ -0,0 +1,29 @@
+#!/bin/sh
+# Broadcasts large lines through the threaded server with ordinary and MSG_ZEROCOPY sends
+# and prints the server's CPU time per byte written to clients. Over loopback the kernel
+# copies zero-copy data on delivery anyway, so the gain only shows with clients behind a NIC.
+# Usage: bench_zerocopy.sh [bin_dir] [port]
+# Environment: SESSIONS (clients), LINES (lines replayed), LINE_BYTES (size of each line),
+#              THRESHOLD (--zerocopy threshold)
+BIN=${1:-.}
+PORT=${2:-7789}
+SESSIONS=${SESSIONS:-50}
+LINES=${LINES:-400}
+LINE_BYTES=${LINE_BYTES:-65536}
+THRESHOLD=${THRESHOLD:-16384}
+CAPTURE=$(mktemp)
+REPORT=$(mktemp)
+
+"$BIN/replay" --generate "$CAPTURE" --sessions "$SESSIONS" --lines "$LINES" \
+  --line-bytes "$LINE_BYTES" --shutdown
+
+for MODE in 0 "$THRESHOLD"; do
+  "$BIN/threaded" "$PORT" --zerocopy "$MODE" --presence-interval 0 >"$REPORT" 2>&1 &
+  SERVER=$!
+  sleep 0.5
+  echo "=== threaded --zerocopy $MODE"
+  "$BIN/replay" "$CAPTURE" 127.0.0.1 "$PORT" --speed 0 | head -1
+  wait "$SERVER"
+  grep -a "bytes to clients" "$REPORT"
+done
+rm -f "$CAPTURE" "$REPORT"
@@ -0,0 +1,395 @@
+#ifndef CHAT_INDEX_HPP
+#define CHAT_INDEX_HPP
+
+#include <algorithm>
+#include <cctype>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Chat history with an incrementally built inverted index for /search.
+//
+// New lines go to the active segment, a plain hash map of uncompressed posting vectors, so
+// add() costs a tokenization and a few push_backs. Every SEGMENT_LINES lines the active segment
+// is frozen and handed to a background thread, which turns it into an immutable segment (sorted
+// terms, posting lists delta+varint encoded) and merges segments tier by tier, MERGE_FANIN at a
+// time, so the number of segments stays logarithmic. Queries see the active, frozen and
+// immutable segments; line ids are global and increasing, so posting lists of consecutive
+// segments just concatenate.
+//
+// Query syntax: space separated terms are ANDed, "quoted words" must appear as a phrase,
+// -term excludes, and OR separates alternatives: alice "merge request" OR -bot deploy
+class ChatIndex {
+public:
+  enum {
+    SEGMENT_LINES = 8192,
+    MERGE_FANIN = 4,
+    MAX_RESULTS = 20
+  };
+
+  ChatIndex() :
+    _active(new ActiveSegment(0)),
+    _stopping(false),
+    _merger(std::bind(&ChatIndex::mergerThread, this)) { }
+
+  ~ChatIndex() {
+    {
+      std::lock_guard<std::mutex> guard(_mutex);
+      _stopping = true;
+    }
+    _mergerCondition.notify_one();
+    _merger.join();
+  }
+
+  // 'display' is what /search returns, 'text' what gets indexed.
+  void add(const std::shared_ptr<std::string>& display, const std::string& text) {
+    std::vector<std::string> terms = tokenize(text);
+    std::sort(terms.begin(), terms.end());
+    terms.erase(std::unique(terms.begin(), terms.end()), terms.end());
+
+    std::lock_guard<std::mutex> guard(_mutex);
+    uint32_t id = static_cast<uint32_t>(_lines.size());
+    _lines.push_back(display);
+    for (auto& term : terms) {
+      _active->postings[std::move(term)].push_back(id);
+    }
+    if (id + 1 - _active->first >= SEGMENT_LINES) {
+      _active->end = id + 1;
+      _frozen.push_back(std::move(_active));
+      _active.reset(new ActiveSegment(id + 1));
+      _mergerCondition.notify_one();
+    }
+  }
+
+  // Returns up to 'limit' most recent matching lines, oldest first.
+  std::vector<std::shared_ptr<std::string> > search(const std::string& query, size_t limit) {
+    std::vector<uint32_t> result;
+    for (const auto& alternative : parseQuery(query)) {
+      std::vector<uint32_t> ids = evaluate(alternative, limit);
+      std::vector<uint32_t> merged;
+      std::set_union(result.begin(), result.end(), ids.begin(), ids.end(),
+		     std::back_inserter(merged));
+      result.swap(merged);
+    }
+    if (result.size() > limit) {
+      result.erase(result.begin(), result.end() - limit);
+    }
+    std::vector<std::shared_ptr<std::string> > lines;
+    std::lock_guard<std::mutex> guard(_mutex);
+    for (uint32_t id : result) {
+      lines.push_back(_lines[id]);
+    }
+    return lines;
+  }
+
+  static std::vector<std::string> tokenize(const std::string& text) {
+    std::vector<std::string> terms;
+    std::string term;
+    for (char c : text) {
+      if (std::isalnum(static_cast<unsigned char>(c))) {
+	term.push_back(static_cast<char>(std::tolower(static_cast<unsigned char>(c))));
+      }
+      else if (! term.empty()) {
+	terms.push_back(std::move(term));
+	term.clear();
+      }
+    }
+    if (! term.empty()) {
+      terms.push_back(std::move(term));
+    }
+    return terms;
+  }
+
+private:
+  typedef std::vector<uint32_t> Postings;
+
+  struct ActiveSegment {
+    explicit ActiveSegment(uint32_t firstLine) :
+      first(firstLine),
+      end(firstLine) { }
+
+    uint32_t first;
+    uint32_t end;
+    std::unordered_map<std::string, Postings> postings;
+  };
+
+  // Postings are varint-encoded gaps; the first gap is relative to 'first'.
+  struct Segment {
+    uint32_t first;
+    uint32_t end;
+    std::vector<std::string> terms;
+    std::vector<std::string> postings;
+
+    void appendPostings(const std::string& term, Postings& out) const {
+      auto found = std::lower_bound(terms.begin(), terms.end(), term);
+      if (found != terms.end() && *found == term) {
+	decode(postings[found - terms.begin()], first, out);
+      }
+    }
+  };
+
+  struct Clause {
+    std::vector<std::vector<std::string> > phrases;  // single words are one-word phrases
+    std::vector<std::string> excluded;
+  };
+
+  static void encode(const Postings& ids, uint32_t base, std::string& out) {
+    uint32_t previous = base;
+    for (uint32_t id : ids) {
+      uint32_t gap = id - previous;
+      previous = id;
+      while (gap >= 0x80) {
+	out.push_back(static_cast<char>(gap | 0x80));
+	gap >>= 7;
+      }
+      out.push_back(static_cast<char>(gap));
+    }
+  }
+
+  static void decode(const std::string& bytes, uint32_t base, Postings& out) {
+    uint32_t id = base;
+    uint32_t gap = 0;
+    int shift = 0;
+    for (char c : bytes) {
+      uint8_t byte = static_cast<uint8_t>(c);
+      gap |= static_cast<uint32_t>(byte & 0x7f) << shift;
+      if (byte & 0x80) {
+	shift += 7;
+	continue;
+      }
+      id += gap;
+      out.push_back(id);
+      gap = 0;
+      shift = 0;
+    }
+  }
+
+  static std::shared_ptr<const Segment> seal(const ActiveSegment& active) {
+    std::vector<const std::pair<const std::string, Postings>*> entries;
+    entries.reserve(active.postings.size());
+    for (const auto& entry : active.postings) {
+      entries.push_back(&entry);
+    }
+    std::sort(entries.begin(), entries.end(),
+	      [](const std::pair<const std::string, Postings>* lhs,
+		 const std::pair<const std::string, Postings>* rhs) { return lhs->first < rhs->first; });
+    auto segment = std::make_shared<Segment>();
+    segment->first = active.first;
+    segment->end = active.end;
+    segment->terms.reserve(entries.size());
+    segment->postings.resize(entries.size());
+    for (size_t i = 0; i < entries.size(); ++i) {
+      segment->terms.push_back(entries[i]->first);
+      encode(entries[i]->second, active.first, segment->postings[i]);
+    }
+    return segment;
+  }
+
+  // Segments must be consecutive in line order.
+  static std::shared_ptr<const Segment> merge(const std::vector<std::shared_ptr<const Segment> >& parts) {
+    std::vector<std::string> terms;
+    for (const auto& part : parts) {
+      std::vector<std::string> merged;
+      std::set_union(terms.begin(), terms.end(), part->terms.begin(), part->terms.end(),
+		     std::back_inserter(merged));
+      terms.swap(merged);
+    }
+    auto segment = std::make_shared<Segment>();
+    segment->first = parts.front()->first;
+    segment->end = parts.back()->end;
+    segment->postings.resize(terms.size());
+    Postings ids;
+    for (size_t i = 0; i < terms.size(); ++i) {
+      ids.clear();
+      for (const auto& part : parts) {
+	part->appendPostings(terms[i], ids);
+      }
+      encode(ids, segment->first, segment->postings[i]);
+    }
+    segment->terms.swap(terms);
+    return segment;
+  }
+
+  void mergerThread() {
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (true) {
+      _mergerCondition.wait(lock, [this]() { return _stopping || ! _frozen.empty(); });
+      if (_stopping) {
+	return;
+      }
+      std::shared_ptr<const ActiveSegment> frozen = _frozen.front();
+      lock.unlock();
+      auto segment = seal(*frozen);
+      lock.lock();
+      _segments.push_back(segment);
+      _frozen.pop_front();
+
+      // Only this thread changes _segments, so the tail can be merged without the lock.
+      while (_segments.size() >= MERGE_FANIN) {
+	std::vector<std::shared_ptr<const Segment> > tail(_segments.end() - MERGE_FANIN, _segments.end());
+	uint32_t lines = tail.front()->end - tail.front()->first;
+	bool sameTier = std::all_of(tail.begin(), tail.end(), [lines](const std::shared_ptr<const Segment>& s) {
+	    return s->end - s->first == lines;
+	  });
+	if (! sameTier) {
+	  break;
+	}
+	lock.unlock();
+	auto merged = merge(tail);
+	lock.lock();
+	_segments.erase(_segments.end() - MERGE_FANIN, _segments.end());
+	_segments.push_back(merged);
+      }
+    }
+  }
+
+  // Ids of all lines containing 'term', in increasing order.
+  Postings lookup(const std::string& term) {
+    Postings ids;
+    std::vector<std::shared_ptr<const Segment> > segments;
+    std::vector<std::shared_ptr<const ActiveSegment> > frozen;
+    Postings active;
+    {
+      std::lock_guard<std::mutex> guard(_mutex);
+      segments = _segments;
+      frozen.assign(_frozen.begin(), _frozen.end());
+      auto found = _active->postings.find(term);
+      if (found != _active->postings.end()) {
+	active = found->second;
+      }
+    }
+    for (const auto& segment : segments) {
+      segment->appendPostings(term, ids);
+    }
+    for (const auto& segment : frozen) {
+      auto found = segment->postings.find(term);
+      if (found != segment->postings.end()) {
+	ids.insert(ids.end(), found->second.begin(), found->second.end());
+      }
+    }
+    ids.insert(ids.end(), active.begin(), active.end());
+    return ids;
+  }
+
+  Postings evaluate(const Clause& clause, size_t limit) {
+    Postings result;
+    bool first = true;
+    for (const auto& phrase : clause.phrases) {
+      for (const auto& term : phrase) {
+	Postings ids = lookup(term);
+	if (first) {
+	  result.swap(ids);
+	  first = false;
+	}
+	else {
+	  Postings both;
+	  std::set_intersection(result.begin(), result.end(), ids.begin(), ids.end(),
+				std::back_inserter(both));
+	  result.swap(both);
+	}
+      }
+    }
+    for (const auto& term : clause.excluded) {
+      Postings ids = lookup(term);
+      Postings rest;
+      std::set_difference(result.begin(), result.end(), ids.begin(), ids.end(),
+			  std::back_inserter(rest));
+      result.swap(rest);
+    }
+    // The index has no positions, so phrases are confirmed on the remaining lines, newest
+    // first, until 'limit' of them have been; older matches would be cut off anyway.
+    bool havePhrases = std::any_of(clause.phrases.begin(), clause.phrases.end(),
+				   [](const std::vector<std::string>& p) { return p.size() > 1; });
+    if (havePhrases) {
+      Postings confirmed;
+      for (auto id = result.rbegin(); id != result.rend() && confirmed.size() < limit; ++id) {
+	std::shared_ptr<std::string> line;
+	{
+	  std::lock_guard<std::mutex> guard(_mutex);
+	  line = _lines[*id];
+	}
+	std::vector<std::string> words = tokenize(*line);
+	bool all = std::all_of(clause.phrases.begin(), clause.phrases.end(),
+			       [&words](const std::vector<std::string>& p) {
+				 return std::search(words.begin(), words.end(), p.begin(), p.end()) != words.end();
+			       });
+	if (all) {
+	  confirmed.push_back(*id);
+	}
+      }
+      std::reverse(confirmed.begin(), confirmed.end());
+      result.swap(confirmed);
+    }
+    return result;
+  }
+
+  static std::vector<Clause> parseQuery(const std::string& query) {
+    std::vector<Clause> clauses(1);
+    size_t pos = 0;
+    while (pos < query.size()) {
+      if (std::isspace(static_cast<unsigned char>(query[pos]))) {
+	++pos;
+	continue;
+      }
+      bool exclude = query[pos] == '-';
+      if (exclude) {
+	++pos;
+      }
+      size_t end;
+      std::string word;
+      if (pos < query.size() && query[pos] == '"') {
+	end = query.find('"', pos + 1);
+	end = end == std::string::npos ? query.size() : end;
+	word = query.substr(pos + 1, end - pos - 1);
+	++end;
+      }
+      else {
+	end = pos;
+	while (end < query.size() && ! std::isspace(static_cast<unsigned char>(query[end]))) {
+	  ++end;
+	}
+	word = query.substr(pos, end - pos);
+      }
+      pos = end;
+
+      if (word == "OR" && ! exclude) {
+	clauses.emplace_back();
+	continue;
+      }
+      std::vector<std::string> terms = tokenize(word);
+      if (terms.empty()) {
+	continue;
+      }
+      if (exclude) {
+	clauses.back().excluded.insert(clauses.back().excluded.end(), terms.begin(), terms.end());
+      }
+      else {
+	clauses.back().phrases.push_back(terms);
+      }
+    }
+    // A clause with nothing required would match everything.
+    clauses.erase(std::remove_if(clauses.begin(), clauses.end(),
+				 [](const Clause& c) { return c.phrases.empty(); }),
+		  clauses.end());
+    return clauses;
+  }
+
+  std::mutex _mutex;
+  std::deque<std::shared_ptr<std::string> > _lines;
+  std::unique_ptr<ActiveSegment> _active;
+  std::deque<std::shared_ptr<const ActiveSegment> > _frozen;
+  std::vector<std::shared_ptr<const Segment> > _segments;
+  std::condition_variable _mergerCondition;
+  bool _stopping;
+  std::thread _merger;
+};
+
+#endif
@@ -0,0 +1,43 @@
+#!/bin/sh
+# Checks the chat servers' heap allocations per message against a budget: builds them with
+# the allocation profiler, replays the same generated chat against each with
+# CHAT_ALLOC_BUDGET set, and fails if any server exits non-zero, which it does when it went
+# over the budget (or failed otherwise).
+# Usage: check_alloc_budget.sh [build_dir] [port]
+# Environment: BUDGET (allocations per message), SESSIONS, LINES (chat lines replayed)
+set -e
+SRC=$(cd "$(dirname "$0")" && pwd)
+BUILD=${1:-_alloc_build}
+PORT=${2:-7791}
+BUDGET=${BUDGET:-16}
+SESSIONS=${SESSIONS:-20}
+LINES=${LINES:-20000}
+CAPTURE=$(mktemp)
+REPORT=$(mktemp)
+trap 'rm -f "$CAPTURE" "$REPORT"' EXIT
+
+cmake -S "$SRC" -B "$BUILD" -DCMAKE_BUILD_TYPE=Release -DCHAT_ALLOC_PROFILE=ON >/dev/null
+cmake --build "$BUILD" -j"$(nproc)" --target async coroutine threaded replay >/dev/null
+
+# The capture ends in /shutdown, so each server exits and checks its report.
+"$BUILD/replay" --generate "$CAPTURE" --sessions "$SESSIONS" --lines "$LINES" --shutdown
+
+FAILED=""
+for CHAT in async coroutine threaded; do
+  CHAT_ALLOC_BUDGET=$BUDGET "$BUILD/$CHAT" "$PORT" >"$REPORT" 2>&1 &
+  SERVER=$!
+  sleep 0.5
+  "$BUILD/replay" "$CAPTURE" 127.0.0.1 "$PORT" --speed 0 >/dev/null
+  if wait "$SERVER"; then
+    STATUS=ok
+  else
+    STATUS=FAILED
+    FAILED="$FAILED $CHAT"
+  fi
+  echo "$CHAT: $(grep -a "allocations per message" "$REPORT" || echo "no allocation report") ($STATUS)"
+done
+
+if [ -n "$FAILED" ]; then
+  echo "over the budget of $BUDGET allocations per message or failed:$FAILED"
+  exit 1
+fi
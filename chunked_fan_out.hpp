@@ -0,0 +1,120 @@
+#ifndef CHUNKED_FAN_OUT_HPP
+#define CHUNKED_FAN_OUT_HPP
+
+#include <boost/asio.hpp>
+
+#include <deque>
+#include <memory>
+#include <string>
+
+// Broadcasting for servers where every ClientSession lives on a single io_service thread.
+// Sessions can't be touched from other threads, so instead of a worker pool a large broadcast
+// is cut into chunks of 'chunk' recipients, each run as a separate handler. Reads, accepts and
+// writes of other clients get scheduled between the chunks, so a 50k-member room no longer
+// stalls the reactor for the whole loop.
+//
+// Jobs are processed strictly in FIFO order, and once anything is queued every following
+// broadcast queues behind it too, so each recipient still sees messages in the order they
+// were broadcast. The job remembers the name it stopped at rather than a snapshot of
+// recipients: clients joining or leaving mid-broadcast are handled by the map itself.
+template <class Session, class NamesToClientsMap>
+class ChunkedFanOut {
+public:
+  ChunkedFanOut(boost::asio::io_service& ioService, NamesToClientsMap& recipients,
+		size_t threshold, size_t chunk) :
+    _ioService(ioService),
+    _recipients(recipients),
+    _threshold(threshold),
+    _chunk(chunk),
+    _scheduled(false) { }
+
+  void broadcast(Session& sender, const std::shared_ptr<std::string>& msg) {
+    if (_jobs.empty() && (_threshold == 0 || _recipients.size() < _threshold)) {
+      for (const auto& kvPair : _recipients) {
+	Session* receiver = kvPair.second.get();
+	if (receiver != &sender) {
+	  receiver->sendMessage(msg);
+	}
+      }
+      return;
+    }
+    _jobs.push_back(Job{ sender.shared_from_this(), msg, std::string(), true, nullptr });
+    schedule();
+  }
+
+  // Message for every client, e.g. from the server itself.
+  void broadcastToAll(const std::shared_ptr<std::string>& msg) {
+    if (_jobs.empty() && (_threshold == 0 || _recipients.size() < _threshold)) {
+      for (const auto& kvPair : _recipients) {
+	kvPair.second->sendMessage(msg);
+      }
+      return;
+    }
+    _jobs.push_back(Job{ nullptr, msg, std::string(), true, nullptr });
+    schedule();
+  }
+
+  // Message for a single client, kept in order behind broadcasts still being delivered.
+  void sendTo(Session& receiver, const std::shared_ptr<std::string>& msg) {
+    if (_jobs.empty()) {
+      receiver.sendMessage(msg);
+      return;
+    }
+    _jobs.push_back(Job{ nullptr, msg, std::string(), true, receiver.shared_from_this() });
+    schedule();
+  }
+
+private:
+  struct Job {
+    std::shared_ptr<Session> sender;
+    std::shared_ptr<std::string> msg;
+    std::string cursor;
+    bool fromBeginning;
+    std::shared_ptr<Session> target;  // set for sendTo() jobs
+  };
+
+  void schedule() {
+    if (! _scheduled) {
+      _scheduled = true;
+      _ioService.post(std::bind(&ChunkedFanOut::processChunk, this));
+    }
+  }
+
+  void processChunk() {
+    _scheduled = false;
+    Job& job = _jobs.front();
+    if (job.target) {
+      job.target->sendMessage(job.msg);
+      _jobs.pop_front();
+      if (! _jobs.empty()) {
+	schedule();
+      }
+      return;
+    }
+    auto it = job.fromBeginning ? _recipients.begin() : _recipients.upper_bound(&job.cursor);
+    for (size_t n = 0; n < _chunk && it != _recipients.end(); ++n, ++it) {
+      if (it->second != job.sender) {
+	it->second->sendMessage(job.msg);
+      }
+    }
+    if (it == _recipients.end()) {
+      _jobs.pop_front();
+    }
+    else {
+      job.fromBeginning = false;
+      job.cursor = *std::prev(it)->first;
+    }
+    if (! _jobs.empty()) {
+      schedule();
+    }
+  }
+
+  boost::asio::io_service& _ioService;
+  NamesToClientsMap& _recipients;
+  size_t _threshold;
+  size_t _chunk;
+  std::deque<Job> _jobs;
+  bool _scheduled;
+};
+
+#endif
@@ -1,9 +1,22 @@
 #include <boost/asio.hpp>
 #include <boost/asio/spawn.hpp>
-#include <boost/date_time.hpp>
 #include <boost/lexical_cast.hpp>
 
+#include "accept_controller.hpp"
+#include "alloc_profiler.hpp"
+#include "chat_index.hpp"
+#include "chunked_fan_out.hpp"
+#include "flood_filter.hpp"
+#include "mailbox_store.hpp"
+#include "mention_matcher.hpp"
+#include "presence_batcher.hpp"
+#include "server_options.hpp"
+#include "traffic_capture.hpp"
+#include "tsc_clock.hpp"
+#include "unix_listener.hpp"
+
 #include <deque>
+#include <iostream>
 #include <map>
 
 #include <functional>
@@ -59,9 +72,12 @@ public:
     _socket(ioService),
     _nameValid(false),
     _writerCondition(ioService),
-    _state(ALL_RUNNING) { }
+    _state(ALL_RUNNING),
+    _started(false),
+    _captureId(0) { }
+  ~ClientSession();
 
-  tcp::socket &socket() {
+  StreamSocket &socket() {
     return _socket;
   }
 
@@ -83,6 +99,7 @@ private:
   void readerThread(boost::asio::yield_context yield);
   std::string readLineFromClient(boost::asio::yield_context yield);
   bool parseLine(const std::string& line);
+  void record(CaptureEvent event, const std::string& payload = std::string());
   void writerThread(boost::asio::yield_context yield);
   std::shared_ptr<std::string> getMessage(boost::asio::yield_context yield);
 
@@ -102,13 +119,15 @@ private:
 
   ChatServer& _server;
   boost::asio::io_service& _ioService;
-  tcp::socket _socket;
+  StreamSocket _socket;
   std::string _name;
   bool _nameValid;
   boost::asio::streambuf _inputBuffer;
   ConditionVariable _writerCondition;
   std::deque<std::shared_ptr<std::string> > _outputData;
   int _state;
+  bool _started;
+  uint32_t _captureId;
 };
 
 template <class T>
@@ -130,24 +149,70 @@ typedef std::map<const std::string*, std::shared_ptr<ClientSession>, PtrLess<std
 
 class ChatServer {
 public:
-  ChatServer(int port) :
-    _acceptor(_ioService, tcp::endpoint(tcp::v4(), port)) { }
+  ChatServer(const ServerOptions& options) :
+    _options(options),
+    _recorder(options.recordPath.empty() ? nullptr : new TrafficRecorder(options.recordPath)),
+    _mailboxes(options.mailboxPath.empty() ? nullptr : new MailboxStore(options.mailboxPath)),
+    _floodFilter(options.floodLimit, std::chrono::seconds(options.floodWindowSec)),
+    _acceptController(options.maxConnections),
+    _acceptor(_ioService, tcp::endpoint(tcp::v4(), options.port)),
+    _unixAcceptor(_ioService),
+    _fanOut(_ioService, _namesToClients, options.fanOutThreshold, options.fanOutChunk) {
+    if (! options.unixPath.empty()) {
+      openUnixAcceptor(_unixAcceptor, options.unixPath);
+    }
+  }
 
   void run();
 
   bool setClientName(const std::shared_ptr<ClientSession>& client, const std::string &name);
   void broadcast(ClientSession& sender, const std::shared_ptr<std::string>& msg);
+  void notifyMentions(ClientSession& sender, const std::string& line);
+  void addToHistory(ClientSession& sender, const std::string& line,
+		    const std::shared_ptr<std::string>& msg);
+  bool admitLine(ClientSession& sender, const std::string& line);
+  void search(ClientSession& client, const std::string& query);
+  void sendPrivate(ClientSession& sender, const std::string& args);
+  std::vector<std::shared_ptr<std::string> > peekMail(const std::string& name);
+  void ackMail(const std::string& name, const std::vector<std::shared_ptr<std::string> >& mail);
   void removeClient(ClientSession& client);
+  void connectionClosed();
   void shutdown();
-private:
-  void acceptThread(boost::asio::yield_context yield);
 
+  // Null unless traffic capture was requested.
+  TrafficRecorder* recorder() {
+    return _recorder.get();
+  }
+private:
+  void presenceThread(boost::asio::yield_context yield);
+  template <class Acceptor>
+  void acceptThread(Acceptor& acceptor, boost::asio::yield_context yield);
+
+  ServerOptions _options;
+  std::unique_ptr<TrafficRecorder> _recorder;
+  std::unique_ptr<MailboxStore> _mailboxes;
+  FloodFilter _floodFilter;
+  AcceptController _acceptController;  // before _ioService, whose queued sessions close into it
   boost::asio::io_service _ioService;
   tcp::acceptor _acceptor;
+  boost::asio::local::stream_protocol::acceptor _unixAcceptor;
   NamesToClientsMap _namesToClients;
+  ChunkedFanOut<ClientSession, NamesToClientsMap> _fanOut;
+  MentionMatcher _mentions;
+  ChatIndex _history;
+  PresenceBatcher _presence;
 };
 
+ClientSession::~ClientSession() {
+  record(CaptureEvent::DISCONNECT);
+  if (_started) {
+    _server.connectionClosed();
+  }
+}
+
 void ClientSession::start() {
+  _started = true;
+  record(CaptureEvent::CONNECT);
   boost::asio::spawn(_ioService, std::bind(&ClientSession::readerThread, shared_from_this(), _1));
   boost::asio::spawn(_ioService, std::bind(&ClientSession::writerThread, shared_from_this(), _1));
 }
@@ -165,9 +230,17 @@ void ClientSession::readerThread(boost::asio::yield_context yield) {
     while (! loginSuccessfull) {
       asyncWrite(boost::asio::buffer(str, sizeof(str)-1), yield);
       std::string name = readLineFromClient(yield);
+      record(CaptureEvent::NAME, name);
       if ((loginSuccessfull = _server.setClientName(shared_from_this(), name))) {
 	std::string response = "Welcome to the chat, " + name + "!\n";
-	asyncWrite(boost::asio::buffer(response), yield);
+	// Messages left while the user was away go out in the same write as the greeting.
+	auto mail = _server.peekMail(name);
+	std::vector<boost::asio::const_buffer> buffers{ boost::asio::buffer(response) };
+	for (const auto& msg : mail) {
+	  buffers.push_back(boost::asio::buffer(*msg));
+	}
+	asyncWrite(buffers, yield);
+	_server.ackMail(name, mail);
       }
       else {
 	std::string response = "Name '" + name + "' is already taken, invent another one.\n";
@@ -190,6 +263,8 @@ std::string ClientSession::readLineFromClient(boost::asio::yield_context yield)
   if (ec) {
     throw boost::system::system_error(ec);
   }
+  // Scopes must not span a yield, or other coroutines' allocations would be charged to them.
+  AllocScope readScope(AllocTag::READ);
   std::istream stream(&_inputBuffer);
   std::string line;
   std::getline(stream, line);
@@ -197,6 +272,8 @@ std::string ClientSession::readLineFromClient(boost::asio::yield_context yield)
 }
 
 bool ClientSession::parseLine(const std::string& line) {
+  AllocScope parseScope(AllocTag::PARSE);
+  record(CaptureEvent::LINE, line);
   if (line == "/quit") {
     return false;
   }
@@ -204,14 +281,51 @@ bool ClientSession::parseLine(const std::string& line) {
     _server.shutdown();
     return false;
   }
+  else if (line.compare(0, 5, "/msg ") == 0) {
+    _server.sendPrivate(*this, line.substr(5));
+    return true;
+  }
+  else if (line.compare(0, 8, "/search ") == 0) {
+    _server.search(*this, line.substr(8));
+    return true;
+  }
+  else if (! _server.admitLine(*this, line)) {
+    return true;
+  }
   else {
-    std::ostringstream stream;
-    stream << boost::posix_time::microsec_clock::local_time() << ' ' << _name << " > " << line << std::endl;
-    _server.broadcast(*this, std::make_shared<std::string>(stream.str()));
+    countAllocProfiledMessage();
+    std::shared_ptr<std::string> msg;
+    {
+      AllocScope formatScope(AllocTag::FORMAT);
+      msg = std::make_shared<std::string>();
+      msg->reserve(LOCAL_TIMESTAMP_SIZE + _name.size() + line.size() + 4);
+      appendLocalTimestamp(*msg, TscClock::instance().realtimeNow());
+      *msg += ' ';
+      *msg += _name;
+      *msg += " > ";
+      *msg += line;
+      *msg += '\n';
+    }
+    AllocScope broadcastScope(AllocTag::BROADCAST);
+    _server.broadcast(*this, msg);
+    _server.addToHistory(*this, line, msg);
+    _server.notifyMentions(*this, line);
     return true;
   }
 }
 
+void ClientSession::record(CaptureEvent event, const std::string& payload) {
+  TrafficRecorder* recorder = _server.recorder();
+  if (recorder) {
+    if (event == CaptureEvent::CONNECT) {
+      _captureId = recorder->newSession();
+    }
+    if (_captureId) {
+      recorder->record(event, _captureId, payload);
+    }
+  }
+}
+
 void ClientSession::onReaderShutdown() {
   int oldState = _state;
   _state = oldState | READER_TERMINATED;
@@ -285,19 +399,71 @@ void ClientSession::terminate() {
 }
 
 void ChatServer::run() {
-  boost::asio::spawn(_ioService,  std::bind(&ChatServer::acceptThread, this, _1));
-  _ioService.run();
+  if (! _options.cpus.empty()) {
+    pinCurrentThreadToCpu(_options.cpus.front());
+  }
+  boost::asio::spawn(_ioService,  std::bind(&ChatServer::acceptThread<tcp::acceptor>, this,
+					   std::ref(_acceptor), _1));
+  if (_unixAcceptor.is_open()) {
+    boost::asio::spawn(_ioService,
+		       std::bind(&ChatServer::acceptThread<boost::asio::local::stream_protocol::acceptor>,
+				 this, std::ref(_unixAcceptor), _1));
+  }
+  if (_options.presenceIntervalMs > 0) {
+    boost::asio::spawn(_ioService, std::bind(&ChatServer::presenceThread, this, _1));
+  }
+  if (_options.spin) {
+    runSpinning(_ioService);
+  }
+  else {
+    _ioService.run();
+  }
+}
+
+void ChatServer::presenceThread(boost::asio::yield_context yield) {
+  boost::asio::steady_timer timer(_ioService);
+  while (true) {
+    timer.expires_from_now(std::chrono::milliseconds(_options.presenceIntervalMs));
+    timer.async_wait(yield);
+    std::string summary = _presence.flush();
+    if (! summary.empty()) {
+      _fanOut.broadcastToAll(std::make_shared<std::string>(std::move(summary)));
+    }
+  }
 }
 
-void ChatServer::acceptThread(boost::asio::yield_context yield) {
+template <class Acceptor>
+void ChatServer::acceptThread(Acceptor& acceptor, boost::asio::yield_context yield) {
   boost::system::error_code ec;
+  boost::asio::steady_timer timer(_ioService);
   while (true) {
+    if (! _acceptController.admitting()) {
+      timer.expires_from_now(std::chrono::milliseconds(AcceptController::ADMISSION_RETRY_MS));
+      timer.async_wait(yield);
+      continue;
+    }
     std::shared_ptr<ClientSession> client = std::make_shared<ClientSession>(*this, _ioService);
-    _acceptor.async_accept(client->socket(), yield[ec]);
+    acceptor.async_accept(client->socket(), yield[ec]);
+    if (ec == boost::asio::error::operation_aborted) {
+      return;
+    }
     if (ec) {
-      throw boost::system::system_error(ec);
+      auto delay = _acceptController.failed(ec, acceptor.native_handle());
+      std::cout << "Accept error: " << ec << ", retrying in " << delay.count() << " ms"
+		<< std::endl;
+      timer.expires_from_now(delay);
+      timer.async_wait(yield);
+      continue;
     }
+    if (_options.busyPollUsec > 0) {
+      enableBusyPoll(client->socket().native_handle(), _options.busyPollUsec);
+    }
+    _acceptController.connectionOpened();
     client->start();
+    if (! _acceptController.admitting()) {
+      std::cout << "Accepting paused at " << _acceptController.maxConnections()
+		<< " connections" << std::endl;
+    }
   }
 }
 
@@ -306,8 +472,11 @@ bool ChatServer::setClientName(const std::shared_ptr<ClientSession>& client,
   NamesToClientsMap::iterator found = _namesToClients.find(&name);
   if (found == _namesToClients.end()) {
     client->setName(name);
-    auto res = _namesToClients.insert(std::make_pair(client->getName(), client));
-    assert(res.second);
+    _namesToClients.emplace(client->getName(), client);
+    _mentions.add(name);
+    if (_options.presenceIntervalMs > 0) {
+      _presence.joined(name);
+    }
     return true;
   }
   else {
@@ -317,16 +486,95 @@ bool ChatServer::setClientName(const std::shared_ptr<ClientSession>& client,
 
 void ChatServer::broadcast(ClientSession& sender,
 			   const std::shared_ptr<std::string>& msg) {
-  for (const auto& kvPair : _namesToClients) {
-    ClientSession* receiver = kvPair.second.get();
-    if (receiver != &sender) {
-      receiver->sendMessage(msg);
+  _fanOut.broadcast(sender, msg);
+}
+
+void ChatServer::notifyMentions(ClientSession& sender, const std::string& line) {
+  std::vector<std::string> names;
+  _mentions.scan(line, names);
+  if (names.empty()) {
+    return;
+  }
+  auto msg = std::make_shared<std::string>("*** " + *sender.getName() + " mentioned you\n");
+  for (const auto& name : names) {
+    NamesToClientsMap::iterator found = _namesToClients.find(&name);
+    if (found != _namesToClients.end() && found->second.get() != &sender) {
+      _fanOut.sendTo(*found->second, msg);
     }
   }
 }
 
+bool ChatServer::admitLine(ClientSession& sender, const std::string& line) {
+  if (! _floodFilter.enabled() || _floodFilter.admit(line)) {
+    return true;
+  }
+  _fanOut.sendTo(sender, std::make_shared<std::string>("*** Repeated message dropped\n"));
+  return false;
+}
+
+void ChatServer::addToHistory(ClientSession& sender, const std::string& line,
+			      const std::shared_ptr<std::string>& msg) {
+  _history.add(msg, *sender.getName() + ' ' + line);
+}
+
+void ChatServer::search(ClientSession& client, const std::string& query) {
+  auto lines = _history.search(query, ChatIndex::MAX_RESULTS);
+  auto msg = std::make_shared<std::string>("*** " + boost::lexical_cast<std::string>(lines.size())
+					   + " matches for " + query + '\n');
+  for (const auto& line : lines) {
+    *msg += *line;
+  }
+  _fanOut.sendTo(client, msg);
+}
+
+void ChatServer::sendPrivate(ClientSession& sender, const std::string& args) {
+  size_t space = args.find(' ');
+  if (space == std::string::npos || space == 0) {
+    _fanOut.sendTo(sender, std::make_shared<std::string>("*** Usage: /msg <name> <text>\n"));
+    return;
+  }
+  std::string name = args.substr(0, space);
+  std::string text;
+  appendLocalTimestamp(text, TscClock::instance().realtimeNow());
+  text += ' ' + *sender.getName() + " -> " + name + ": " + args.substr(space + 1) + '\n';
+
+  NamesToClientsMap::iterator found = _namesToClients.find(&name);
+  if (found != _namesToClients.end()) {
+    _fanOut.sendTo(*found->second, std::make_shared<std::string>(text));
+  }
+  else if (_mailboxes) {
+    bool saved = _mailboxes->deposit(name, text);
+    _fanOut.sendTo(sender, std::make_shared<std::string>("*** " + name + " is offline, message " +
+							 (saved ? "saved\n" : "not saved\n")));
+  }
+  else {
+    _fanOut.sendTo(sender, std::make_shared<std::string>("*** " + name + " is not online\n"));
+  }
+}
+
+std::vector<std::shared_ptr<std::string> > ChatServer::peekMail(const std::string& name) {
+  return _mailboxes ? _mailboxes->peek(name) : std::vector<std::shared_ptr<std::string> >();
+}
+
+// Once the mail from peekMail() has been written to the client.
+void ChatServer::ackMail(const std::string& name,
+			 const std::vector<std::shared_ptr<std::string> >& mail) {
+  if (_mailboxes && ! mail.empty()) {
+    _mailboxes->ack(name, mail);
+  }
+}
+
 void ChatServer::removeClient(ClientSession& client) {
-  _namesToClients.erase(client.getName());
+  if (_namesToClients.erase(client.getName()) == 1) {
+    _mentions.remove(*client.getName());
+    if (_options.presenceIntervalMs > 0) {
+      _presence.left(*client.getName());
+    }
+  }
+}
+
+void ChatServer::connectionClosed() {
+  _acceptController.connectionClosed();
 }
 
 void ChatServer::shutdown() {
@@ -334,17 +582,30 @@ void ChatServer::shutdown() {
 }
 
 int main(int argc, char **argv) {
+  ServerOptions options;
   try {
-    if (argc < 2) {
-      std::cerr << "Usage: " << argv[0] << " <port>\n";
-      return 1;
-    }
-    std::unique_ptr<ChatServer> server(new ChatServer(boost::lexical_cast<int>(argv[1])));
+    options = parseServerOptions(argc, argv);
+  }
+  catch (std::exception &ex) {
+    std::cerr << ex.what() << std::endl;
+    printServerUsage(std::cerr, argv[0]);
+    return 1;
+  }
+
+  // Calibrating the clock busy-waits 20 ms: done here rather than by the first message.
+  TscClock::instance();
+  int status = 0;
+  try {
+    std::unique_ptr<ChatServer> server(new ChatServer(options));
     server->run();
-    return 0;
   }
   catch (std::exception &ex) {
     std::cerr << "Main thread exception: " << ex.what() << std::endl;
-    return 1;
+    status = 1;
+  }
+  // After the server is gone, so its threads' allocations are all in.
+  if (! reportAllocations(std::cout)) {
+    status = 1;
   }
+  return status;
 }
@@ -0,0 +1,450 @@
+#include <boost/asio.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include "latency_histogram.hpp"
+#include "low_latency.hpp"
+#include "tsc_clock.hpp"
+#include "unix_listener.hpp"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#include <functional>
+
+using boost::asio::ip::tcp;
+using boost::asio::ip::udp;
+typedef boost::asio::generic::stream_protocol::endpoint StreamEndpoint;
+using namespace std::placeholders;
+
+typedef TscSteadyClock Clock;
+
+struct ClientOptions {
+  std::string host;
+  int port = 0;
+  std::string unixPath;
+  enum Mode { PING_PONG, STREAM } mode = PING_PONG;
+  bool udp = false;
+  int connections = 1;
+  int threads = 1;
+  size_t size = 128;
+  int duration = 10;
+  std::vector<int> cpus;
+};
+
+static void printUsage(std::ostream& stream, const char* program) {
+  stream << "Usage: " << program << " <host> <port> [options]\n"
+	 << "       " << program << " --unix <path> [options]\n"
+	 << "  --mode pingpong|stream  latency (one message in flight) or throughput (default pingpong)\n"
+	 << "  --connections <n>       concurrent connections (default 1)\n"
+	 << "  --threads <n>           client threads, each with its own io_service (default 1)\n"
+	 << "  --size <bytes>          message size (default 128)\n"
+	 << "  --duration <seconds>    test length (default 10)\n"
+	 << "  --cpus <list>           pin client threads to these CPUs\n"
+	 << "  --udp                   UDP ping-pong, a batch of 32 datagrams in flight per thread\n"
+	 << "  --unix <path>           connect to a Unix domain socket (@name: abstract namespace)\n";
+}
+
+static ClientOptions parseClientOptions(int argc, char** argv) {
+  ClientOptions options;
+  std::vector<std::string> positional;
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg.compare(0, 2, "--") != 0) {
+      positional.push_back(arg);
+      continue;
+    }
+    auto value = [&]() -> std::string {
+      if (i + 1 >= argc) {
+	throw std::invalid_argument("missing value for " + arg);
+      }
+      return argv[++i];
+    };
+    if (arg == "--mode") {
+      std::string mode = value();
+      if (mode == "pingpong") {
+	options.mode = ClientOptions::PING_PONG;
+      }
+      else if (mode == "stream") {
+	options.mode = ClientOptions::STREAM;
+      }
+      else {
+	throw std::invalid_argument("unknown mode " + mode);
+      }
+    }
+    else if (arg == "--connections") {
+      options.connections = boost::lexical_cast<int>(value());
+    }
+    else if (arg == "--threads") {
+      options.threads = boost::lexical_cast<int>(value());
+    }
+    else if (arg == "--size") {
+      options.size = boost::lexical_cast<size_t>(value());
+    }
+    else if (arg == "--duration") {
+      options.duration = boost::lexical_cast<int>(value());
+    }
+    else if (arg == "--cpus") {
+      options.cpus = parseCpuList(value());
+    }
+    else if (arg == "--udp") {
+      options.udp = true;
+    }
+    else if (arg == "--unix") {
+      options.unixPath = value();
+    }
+    else {
+      throw std::invalid_argument("unknown option " + arg);
+    }
+  }
+  if (positional.size() == 2) {
+    options.host = positional[0];
+    options.port = boost::lexical_cast<int>(positional[1]);
+  }
+  else if (! positional.empty() || options.unixPath.empty()) {
+    throw std::invalid_argument("expected <host> <port> or --unix <path>");
+  }
+  if (options.udp && ! options.unixPath.empty()) {
+    throw std::invalid_argument("--udp and --unix are exclusive");
+  }
+  if (options.connections < 1 || options.threads < 1 || options.size < 1) {
+    throw std::invalid_argument("connections, threads and size must be positive");
+  }
+  return options;
+}
+
+// Everything one client thread measures. Only touched from that thread's io_service.
+struct ThreadStats {
+  LatencyHistogram latency;
+  uint64_t messages = 0;
+  uint64_t bytesSent = 0;
+  uint64_t bytesReceived = 0;
+  int failedConnections = 0;
+  uint64_t lost = 0;  // UDP datagrams not echoed within the loss timeout
+};
+
+class Connection : public std::enable_shared_from_this<Connection> {
+public:
+  Connection(boost::asio::io_service& ioService, const ClientOptions& options,
+	     ThreadStats& stats, const std::atomic<bool>& stopping) :
+    _socket(ioService),
+    _options(options),
+    _stats(stats),
+    _stopping(stopping),
+    _output(options.size, 'x'),
+    _input(options.size) {
+    _output.back() = '\n';
+  }
+
+  void start(const StreamEndpoint& endpoint) {
+    _socket.async_connect(endpoint, std::bind(&Connection::onConnect, shared_from_this(), _1));
+  }
+
+private:
+  void onConnect(const boost::system::error_code& error) {
+    if (error) {
+      std::cerr << "Connect error: " << error.message() << std::endl;
+      ++_stats.failedConnections;
+      return;
+    }
+    if (_options.unixPath.empty()) {
+      _socket.set_option(tcp::no_delay(true));
+    }
+    if (_options.mode == ClientOptions::PING_PONG) {
+      sendPing();
+    }
+    else {
+      writeChunk();
+      readChunk();
+    }
+  }
+
+  void sendPing() {
+    if (_stopping) {
+      close();
+      return;
+    }
+    _sent = Clock::now();
+    boost::asio::async_write(_socket, boost::asio::buffer(_output),
+			     std::bind(&Connection::onPingSent, shared_from_this(), _1, _2));
+  }
+
+  void onPingSent(const boost::system::error_code& error, size_t bytes) {
+    if (error) {
+      handleError(error);
+      return;
+    }
+    _stats.bytesSent += bytes;
+    boost::asio::async_read(_socket, boost::asio::buffer(_input),
+			    std::bind(&Connection::onPongReceived, shared_from_this(), _1, _2));
+  }
+
+  void onPongReceived(const boost::system::error_code& error, size_t bytes) {
+    if (error) {
+      handleError(error);
+      return;
+    }
+    auto rtt = std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - _sent);
+    _stats.latency.record(rtt.count());
+    _stats.bytesReceived += bytes;
+    ++_stats.messages;
+    sendPing();
+  }
+
+  void writeChunk() {
+    if (_stopping) {
+      close();
+      return;
+    }
+    boost::asio::async_write(_socket, boost::asio::buffer(_output),
+			     std::bind(&Connection::onChunkWritten, shared_from_this(), _1, _2));
+  }
+
+  void onChunkWritten(const boost::system::error_code& error, size_t bytes) {
+    if (error) {
+      handleError(error);
+      return;
+    }
+    _stats.bytesSent += bytes;
+    ++_stats.messages;
+    writeChunk();
+  }
+
+  void readChunk() {
+    _socket.async_read_some(boost::asio::buffer(_input),
+			    std::bind(&Connection::onChunkRead, shared_from_this(), _1, _2));
+  }
+
+  void onChunkRead(const boost::system::error_code& error, size_t bytes) {
+    if (error) {
+      handleError(error);
+      return;
+    }
+    _stats.bytesReceived += bytes;
+    readChunk();
+  }
+
+  void handleError(const boost::system::error_code& error) {
+    if (! _stopping) {
+      std::cerr << "Connection error: " << error.message() << std::endl;
+    }
+    close();
+  }
+
+  void close() {
+    boost::system::error_code ignored;
+    _socket.close(ignored);
+  }
+
+  StreamSocket _socket;
+  const ClientOptions& _options;
+  ThreadStats& _stats;
+  const std::atomic<bool>& _stopping;
+  std::string _output;
+  std::vector<char> _input;
+  Clock::time_point _sent;
+};
+
+static void runStreamThread(const ClientOptions& options, const StreamEndpoint& endpoint,
+			    int connections, ThreadStats& stats, const std::atomic<bool>& stopping) {
+  boost::asio::io_service ioService;
+  for (int i = 0; i < connections; ++i) {
+    std::make_shared<Connection>(ioService, options, stats, stopping)->start(endpoint);
+  }
+
+  // The connections notice the flag on their next completion; the timer only makes sure
+  // idle (e.g. stream readers) sockets get closed too.
+  boost::asio::steady_timer timer(ioService);
+  std::function<void(const boost::system::error_code&)> check;
+  check = [&](const boost::system::error_code&) {
+    if (stopping) {
+      ioService.stop();
+      return;
+    }
+    timer.expires_from_now(std::chrono::milliseconds(100));
+    timer.async_wait(check);
+  };
+  check(boost::system::error_code());
+  ioService.run();
+}
+
+// UDP ping-pong a batch at a time on one connected socket: sends BATCH datagrams, then waits
+// until all of them are back or LOSS_TIMEOUT_MS passed, so exactly one batch is ever in flight
+// and the round trips don't include queueing behind earlier batches. Each datagram carries its
+// round and send time; what doesn't come back within its round counts as lost, and its echo
+// is ignored if it turns up later.
+static void runUdpThread(const ClientOptions& options, const udp::endpoint& endpoint,
+			 ThreadStats& stats, const std::atomic<bool>& stopping) {
+  enum { BATCH = 32, LOSS_TIMEOUT_MS = 100 };
+  struct Stamp {
+    uint64_t round;
+    int64_t sent;
+  };
+  const size_t size = std::max(options.size, sizeof(Stamp));
+
+  int fd = ::socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd < 0) {
+    throw std::system_error(errno, std::system_category(), "socket");
+  }
+  if (::connect(fd, endpoint.data(), endpoint.size()) < 0) {
+    throw std::system_error(errno, std::system_category(), "connect");
+  }
+  timeval timeout = { 0, LOSS_TIMEOUT_MS * 1000 };
+  setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  std::vector<char> output(BATCH * size, 'x');
+  std::vector<char> input(BATCH * size);
+  mmsghdr outMsgs[BATCH], inMsgs[BATCH];
+  iovec outVecs[BATCH], inVecs[BATCH];
+  for (int i = 0; i < BATCH; ++i) {
+    outVecs[i] = { &output[i * size], size };
+    inVecs[i] = { &input[i * size], size };
+    outMsgs[i].msg_hdr = msghdr();
+    outMsgs[i].msg_hdr.msg_iov = &outVecs[i];
+    outMsgs[i].msg_hdr.msg_iovlen = 1;
+    inMsgs[i].msg_hdr = msghdr();
+    inMsgs[i].msg_hdr.msg_iov = &inVecs[i];
+    inMsgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  for (uint64_t round = 1; ! stopping; ++round) {
+    Stamp stamp = { round, std::chrono::duration_cast<std::chrono::nanoseconds>(
+	Clock::now().time_since_epoch()).count() };
+    for (int i = 0; i < BATCH; ++i) {
+      std::memcpy(&output[i * size], &stamp, sizeof(stamp));
+    }
+    int sent = ::sendmmsg(fd, outMsgs, BATCH, 0);
+    if (sent < 0) {
+      // E.g. ECONNREFUSED from an earlier echo that found no server: try again later.
+      stats.lost += BATCH;
+      std::this_thread::sleep_for(std::chrono::milliseconds(LOSS_TIMEOUT_MS));
+      continue;
+    }
+    stats.bytesSent += sent * size;
+    stats.lost += BATCH - sent;
+
+    int pending = sent;
+    auto deadline = Clock::now() + std::chrono::milliseconds(LOSS_TIMEOUT_MS);
+    while (pending > 0 && Clock::now() < deadline) {
+      int received = ::recvmmsg(fd, inMsgs, pending, MSG_WAITFORONE, nullptr);
+      if (received < 0) {
+	if (errno == EINTR) {
+	  continue;
+	}
+	break;  // timed out, or the echo was refused
+      }
+      int64_t arrived = std::chrono::duration_cast<std::chrono::nanoseconds>(
+	Clock::now().time_since_epoch()).count();
+      for (int i = 0; i < received; ++i) {
+	Stamp echoed;
+	std::memcpy(&echoed, &input[i * size], sizeof(echoed));
+	if (inMsgs[i].msg_len < sizeof(echoed) || echoed.round != round) {
+	  continue;
+	}
+	stats.latency.record(arrived - echoed.sent);
+	stats.bytesReceived += inMsgs[i].msg_len;
+	++stats.messages;
+	--pending;
+      }
+    }
+    stats.lost += pending;
+  }
+  ::close(fd);
+}
+
+int main(int argc, char **argv) {
+  ClientOptions options;
+  try {
+    options = parseClientOptions(argc, argv);
+  }
+  catch (std::exception &ex) {
+    std::cerr << ex.what() << std::endl;
+    printUsage(std::cerr, argv[0]);
+    return 1;
+  }
+
+  try {
+    StreamEndpoint endpoint;
+    udp::endpoint udpEndpoint;
+    if (options.unixPath.empty()) {
+      boost::asio::io_service resolverService;
+      tcp::resolver resolver(resolverService);
+      tcp::endpoint tcpEndpoint =
+	*resolver.resolve(tcp::resolver::query(options.host, std::to_string(options.port)));
+      endpoint = tcpEndpoint;
+      udpEndpoint = udp::endpoint(tcpEndpoint.address(), tcpEndpoint.port());
+    }
+    else {
+      endpoint = makeUnixEndpoint(options.unixPath);
+    }
+
+    std::atomic<bool> stopping(false);
+    std::vector<ThreadStats> stats(options.threads);
+    std::vector<std::thread> threads;
+    CpuAssigner cpus(options.cpus);
+    for (int i = 0; i < options.threads; ++i) {
+      if (options.udp) {
+	threads.emplace_back(runUdpThread, std::cref(options), udpEndpoint,
+			     std::ref(stats[i]), std::cref(stopping));
+      }
+      else {
+	// Spread connections evenly, the first threads take the remainder.
+	int connections = options.connections / options.threads +
+	  (i < options.connections % options.threads ? 1 : 0);
+	threads.emplace_back(runStreamThread, std::cref(options), std::cref(endpoint), connections,
+			     std::ref(stats[i]), std::cref(stopping));
+      }
+      if (cpus.enabled()) {
+	pinThreadToCpu(threads.back().native_handle(), cpus.next());
+      }
+    }
+
+    auto start = Clock::now();
+    std::this_thread::sleep_for(std::chrono::seconds(options.duration));
+    stopping = true;
+    for (auto& thread : threads) {
+      thread.join();
+    }
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    ThreadStats total;
+    for (const auto& s : stats) {
+      total.latency.merge(s.latency);
+      total.messages += s.messages;
+      total.bytesSent += s.bytesSent;
+      total.bytesReceived += s.bytesReceived;
+      total.failedConnections += s.failedConnections;
+      total.lost += s.lost;
+    }
+
+    std::cout << (options.udp ? "udp" : options.unixPath.empty() ? "tcp" : "unix") << ' '
+	      << (options.mode == ClientOptions::PING_PONG || options.udp ? "pingpong" : "stream")
+	      << ", " << (options.udp ? options.threads : options.connections) << " connections, "
+	      << options.size << " byte messages, " << seconds << " s\n"
+	      << "  messages    " << total.messages << " (" << total.messages / seconds << "/s)\n"
+	      << "  sent        " << total.bytesSent / seconds / 1e9 << " GB/s\n"
+	      << "  received    " << total.bytesReceived / seconds / 1e9 << " GB/s\n";
+    if (options.udp) {
+      std::cout << "  lost        " << total.lost << " datagrams\n";
+    }
+    if (total.failedConnections) {
+      std::cout << "  failed connections " << total.failedConnections << '\n';
+    }
+    if (total.latency.count()) {
+      std::cout << "round-trip latency:\n";
+      total.latency.print(std::cout, "us", 1000.0);
+    }
+    return 0;
+  }
+  catch (std::exception &ex) {
+    std::cerr << "Main thread exception: " << ex.what() << std::endl;
+    return 1;
+  }
+}
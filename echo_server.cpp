@@ -11,12 +11,26 @@
 #include <boost/asio/deadline_timer.hpp>
 #include <boost/asio/io_service.hpp>
 #include <boost/asio/ip/tcp.hpp>
+#include <boost/asio/signal_set.hpp>
 #include <boost/asio/spawn.hpp>
 #include <boost/asio/write.hpp>
 #include <boost/bind.hpp>
 #include <boost/shared_ptr.hpp>
 #include <boost/enable_shared_from_this.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstring>
 #include <iostream>
+#include <memory>
+#include <system_error>
+#include <thread>
+#include <vector>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <sys/socket.h>
+#include "numa_topology.hpp"
+#include "server_options.hpp"
+#include "unix_listener.hpp"
 
 using boost::asio::ip::tcp;
 
@@ -30,7 +44,7 @@ public:
   {
   }
 
-  tcp::socket& socket()
+  StreamSocket& socket()
   {
     return socket_;
   }
@@ -77,41 +91,419 @@ private:
   }
 
   boost::asio::io_service::strand strand_;
-  tcp::socket socket_;
+  StreamSocket socket_;
   boost::asio::deadline_timer timer_;
 };
 
-void do_accept(boost::asio::io_service& io_service,
-    unsigned short port, boost::asio::yield_context yield)
+// An io_service with its own thread bound to one NUMA node. Sessions are
+// created on that thread, so the session object, its socket and the echo
+// coroutine's stack (which holds the data buffer) all come from node-local
+// memory.
+class reactor
 {
-  tcp::acceptor acceptor(io_service, tcp::endpoint(tcp::v4(), port));
+public:
+  reactor(const NumaNode& node, const ServerOptions& options)
+    : node_(node),
+      options_(options),
+      work_(io_service_)
+  {
+  }
+
+  void start()
+  {
+    thread_ = std::thread(&reactor::run, this);
+  }
+
+  void stop()
+  {
+    io_service_.stop();
+    thread_.join();
+  }
+
+  // Takes ownership of an accepted connection's descriptor.
+  void adopt(const boost::asio::generic::stream_protocol& protocol, int fd)
+  {
+    io_service_.post(boost::bind(&reactor::start_session, this, protocol, fd));
+  }
 
+private:
+  void run()
+  {
+    bindCurrentThreadToNumaNode(node_);
+    if (options_.spin)
+      runSpinning(io_service_);
+    else
+      io_service_.run();
+  }
+
+  void start_session(const boost::asio::generic::stream_protocol& protocol, int fd)
+  {
+    boost::system::error_code ec;
+    boost::shared_ptr<session> new_session(new session(io_service_));
+    new_session->socket().assign(protocol, fd, ec);
+    if (ec)
+    {
+      ::close(fd);
+      return;
+    }
+    new_session->go();
+  }
+
+  NumaNode node_;
+  const ServerOptions& options_;
+  boost::asio::io_service io_service_;
+  boost::asio::io_service::work work_;
+  std::thread thread_;
+};
+
+// Picks the reactor on the node whose CPU took the flow's NIC interrupt,
+// falling back to round-robin when the kernel can't tell.
+class reactor_set
+{
+public:
+  explicit reactor_set(const ServerOptions& options)
+    : nodes_(readNumaTopology()),
+      next_(0)
+  {
+    for (const NumaNode& node : nodes_)
+      reactors_.emplace_back(new reactor(node, options));
+    for (auto& r : reactors_)
+      r->start();
+  }
+
+  ~reactor_set()
+  {
+    for (auto& r : reactors_)
+      r->stop();
+  }
+
+  void dispatch(StreamSocket& socket)
+  {
+    int node = findNumaNodeOfCpu(nodes_, getIncomingCpu(socket.native_handle()));
+    if (node < 0)
+      node = next_++ % reactors_.size();
+    boost::asio::generic::stream_protocol protocol =
+      socket.local_endpoint().protocol();
+    reactors_[node]->adopt(protocol, socket.release());
+  }
+
+private:
+  std::vector<NumaNode> nodes_;
+  std::vector<std::unique_ptr<reactor> > reactors_;
+  std::atomic<size_t> next_;
+};
+
+template <typename Acceptor>
+void accept_loop(boost::asio::io_service& io_service, Acceptor& acceptor,
+    const ServerOptions& options, reactor_set* reactors,
+    boost::asio::yield_context yield)
+{
   for (;;)
   {
     boost::system::error_code ec;
+    if (reactors)
+    {
+      StreamSocket socket(io_service);
+      acceptor.async_accept(socket, yield[ec]);
+      if (ec)
+        continue;
+      if (options.busyPollUsec > 0)
+        enableBusyPoll(socket.native_handle(), options.busyPollUsec);
+      reactors->dispatch(socket);
+      continue;
+    }
+
     boost::shared_ptr<session> new_session(new session(io_service));
     acceptor.async_accept(new_session->socket(), yield[ec]);
-    if (!ec) new_session->go();
+    if (!ec)
+    {
+      if (options.busyPollUsec > 0)
+        enableBusyPoll(new_session->socket().native_handle(), options.busyPollUsec);
+      new_session->go();
+    }
+  }
+}
+
+void do_accept(boost::asio::io_service& io_service,
+    const ServerOptions& options, boost::asio::yield_context yield)
+{
+  tcp::acceptor acceptor(io_service, tcp::endpoint(tcp::v4(), options.port));
+  std::unique_ptr<reactor_set> reactors;
+  if (options.numa)
+    reactors.reset(new reactor_set(options));
+
+  typedef boost::asio::local::stream_protocol::acceptor unix_acceptor_type;
+  unix_acceptor_type unix_acceptor(io_service);
+  if (!options.unixPath.empty())
+  {
+    openUnixAcceptor(unix_acceptor, options.unixPath);
+    boost::asio::spawn(io_service,
+        boost::bind(accept_loop<unix_acceptor_type>, boost::ref(io_service),
+          boost::ref(unix_acceptor), boost::cref(options), reactors.get(), _1));
   }
+
+  accept_loop(io_service, acceptor, options, reactors.get(), yield);
+}
+
+// Batched UDP echo. Every socket binds the same port with SO_REUSEPORT, so the
+// kernel spreads flows across them. Each socket has its own thread, which
+// moves up to batch_size datagrams per recvmmsg/sendmmsg call.
+class udp_echo
+{
+public:
+  enum { batch_size = 64 };
+
+  explicit udp_echo(const ServerOptions& options)
+    : options_(options),
+      packets_(0),
+      bytes_(0),
+      truncated_(0),
+      unsent_(0)
+  {
+  }
+
+  // Never returns; prints throughput once a second.
+  void run()
+  {
+    CpuAssigner cpus(options_.cpus);
+    for (int i = 0; i < options_.udpSockets; ++i)
+    {
+      std::thread t(&udp_echo::serve, this, open_socket());
+      if (cpus.enabled())
+        pinThreadToCpu(t.native_handle(), cpus.next());
+      t.detach();
+    }
+
+    for (;;)
+    {
+      std::this_thread::sleep_for(std::chrono::seconds(1));
+      unsigned long long packets = packets_.exchange(0);
+      unsigned long long bytes = bytes_.exchange(0);
+      unsigned long long truncated = truncated_.exchange(0);
+      unsigned long long unsent = unsent_.exchange(0);
+      std::cout << "udp echo: " << packets << " pps, "
+        << bytes / (1024 * 1024) << " MiB/s";
+      if (truncated || unsent)
+        std::cout << ", dropped " << truncated << " truncated, "
+          << unsent << " unsent";
+      std::cout << std::endl;
+    }
+  }
+
+private:
+  int open_socket()
+  {
+    int fd = ::socket(AF_INET, SOCK_DGRAM, 0);
+    if (fd < 0)
+      throw std::system_error(errno, std::system_category(), "socket");
+    int one = 1;
+    ::setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+    if (options_.udpGro)
+      ::setsockopt(fd, SOL_UDP, UDP_GRO, &one, sizeof(one));
+    if (options_.busyPollUsec > 0)
+      enableBusyPoll(fd, options_.busyPollUsec);
+
+    sockaddr_in addr = sockaddr_in();
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(options_.port);
+    if (::bind(fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0)
+      throw std::system_error(errno, std::system_category(), "bind");
+    return fd;
+  }
+
+  void serve(int fd)
+  {
+    // With GRO the kernel may hand us up to 64k of coalesced segments in one
+    // message; we send them back the same way and let UDP_SEGMENT split them.
+    const std::size_t buffer_size = options_.udpGro ? 65536 : 2048;
+    std::vector<char> buffers(batch_size * buffer_size);
+    mmsghdr msgs[batch_size];
+    iovec iovecs[batch_size];
+    sockaddr_storage addrs[batch_size];
+    union
+    {
+      char buf[CMSG_SPACE(sizeof(int))];
+      cmsghdr align;
+    } controls[batch_size];
+
+    for (;;)
+    {
+      for (int i = 0; i < batch_size; ++i)
+      {
+        iovecs[i].iov_base = &buffers[i * buffer_size];
+        iovecs[i].iov_len = buffer_size;
+        msgs[i].msg_hdr = msghdr();
+        msgs[i].msg_hdr.msg_name = &addrs[i];
+        msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        msgs[i].msg_hdr.msg_iov = &iovecs[i];
+        msgs[i].msg_hdr.msg_iovlen = 1;
+        msgs[i].msg_hdr.msg_control = controls[i].buf;
+        msgs[i].msg_hdr.msg_controllen = sizeof(controls[i].buf);
+      }
+
+      int n = ::recvmmsg(fd, msgs, batch_size, MSG_WAITFORONE, nullptr);
+      if (n < 0)
+      {
+        if (errno == EINTR)
+          continue;
+        std::cerr << "recvmmsg: " << std::strerror(errno) << "\n";
+        return;
+      }
+
+      // Datagrams larger than the buffer arrive cut short; echoing the rest
+      // back would look like a reply, so they are dropped and counted instead.
+      // The others move down to msgs[0, echoed).
+      unsigned long long truncated = 0;
+      unsigned long long msg_packets[batch_size];
+      int echoed = 0;
+      for (int i = 0; i < n; ++i)
+      {
+        if (msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+        {
+          ++truncated;
+          continue;
+        }
+        std::size_t len = msgs[i].msg_len;
+        int segment = received_segment_size(msgs[i].msg_hdr);
+        iovecs[i].iov_len = len;
+        if (segment > 0 && len > static_cast<std::size_t>(segment))
+        {
+          set_segment_size(msgs[i].msg_hdr, segment);
+          msg_packets[echoed] = (len + segment - 1) / segment;
+        }
+        else
+        {
+          msgs[i].msg_hdr.msg_controllen = 0;
+          msg_packets[echoed] = 1;
+        }
+        msgs[echoed++] = msgs[i];
+      }
+
+      // Only what went out counts towards the rate.
+      unsigned long long packets = 0;
+      unsigned long long bytes = 0;
+      unsigned long long unsent = 0;
+      for (int sent = 0; sent < echoed; )
+      {
+        int res = ::sendmmsg(fd, msgs + sent, echoed - sent, 0);
+        if (res < 0)
+        {
+          if (errno == EINTR)
+            continue;
+          // Out of socket buffer, or this one peer is unreachable: UDP is
+          // allowed to drop, so skip just this datagram.
+          ++unsent;
+          ++sent;
+          continue;
+        }
+        for (int i = sent; i < sent + res; ++i)
+        {
+          packets += msg_packets[i];
+          bytes += msgs[i].msg_hdr.msg_iov->iov_len;
+        }
+        sent += res;
+      }
+
+      packets_ += packets;
+      bytes_ += bytes;
+      truncated_ += truncated;
+      unsent_ += unsent;
+    }
+  }
+
+  static int received_segment_size(msghdr& hdr)
+  {
+    for (cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg))
+    {
+      if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO)
+      {
+        int size;
+        std::memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+        return size;
+      }
+    }
+    return 0;
+  }
+
+  static void set_segment_size(msghdr& hdr, int segment)
+  {
+    uint16_t size = static_cast<uint16_t>(segment);
+    hdr.msg_controllen = CMSG_SPACE(sizeof(size));
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr);
+    cmsg->cmsg_level = SOL_UDP;
+    cmsg->cmsg_type = UDP_SEGMENT;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(size));
+    std::memcpy(CMSG_DATA(cmsg), &size, sizeof(size));
+  }
+
+  const ServerOptions& options_;
+  std::atomic<unsigned long long> packets_;
+  std::atomic<unsigned long long> bytes_;
+  std::atomic<unsigned long long> truncated_;
+  std::atomic<unsigned long long> unsent_;
+};
+
+void run_io_service(boost::asio::io_service& io_service,
+    const ServerOptions& options)
+{
+  if (options.spin)
+    runSpinning(io_service);
+  else
+    io_service.run();
 }
 
 int main(int argc, char* argv[])
 {
   try
   {
-    if (argc != 2)
+    ServerOptions options;
+    try
+    {
+      options = parseServerOptions(argc, argv);
+    }
+    catch (std::exception& e)
     {
-      std::cerr << "Usage: echo_server <port>\n";
+      std::cerr << e.what() << "\n";
+      printServerUsage(std::cerr, "echo_server");
       return 1;
     }
 
+    if (options.udpSockets > 0)
+    {
+      udp_echo(options).run();
+      return 0;
+    }
+
     boost::asio::io_service io_service;
 
+    // Stop cleanly on Ctrl-C or kill, so exit handlers (e.g. profile dumps) get to run.
+    boost::asio::signal_set signals(io_service, SIGINT, SIGTERM);
+    signals.async_wait(
+        boost::bind(&boost::asio::io_service::stop, boost::ref(io_service)));
+
     boost::asio::spawn(io_service,
         boost::bind(do_accept,
-          boost::ref(io_service), atoi(argv[1]), _1));
+          boost::ref(io_service), boost::cref(options), _1));
 
-    io_service.run();
+    // Each session's coroutines run in its strand, so any number of threads
+    // may call run() on the shared io_service.
+    CpuAssigner cpus(options.cpus);
+    if (cpus.enabled())
+      pinCurrentThreadToCpu(cpus.next());
+    std::vector<std::thread> threads;
+    for (int i = 1; i < options.threads; ++i)
+    {
+      threads.emplace_back(run_io_service,
+          boost::ref(io_service), boost::cref(options));
+      if (cpus.enabled())
+        pinThreadToCpu(threads.back().native_handle(), cpus.next());
+    }
+
+    run_io_service(io_service, options);
+
+    for (std::size_t i = 0; i < threads.size(); ++i)
+      threads[i].join();
   }
   catch (std::exception& e)
   {
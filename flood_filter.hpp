@@ -0,0 +1,89 @@
+#ifndef FLOOD_FILTER_HPP
+#define FLOOD_FILTER_HPP
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Rejects a line once identical lines have been seen 'limit' times within the last one to two
+// windows, whoever sent them. Counts live in count-min sketches of fixed size, so memory
+// doesn't grow with the traffic and a check is DEPTH counter reads and writes; collisions can
+// only make the estimate too high, and conservative update keeps that error small.
+//
+// Two generations roll over every window: lines are counted in the current one and checked
+// against the sum of both, so a burst straddling a window boundary is still caught.
+// Not thread-safe.
+class FloodFilter {
+public:
+  enum {
+    DEPTH = 4,
+    WIDTH = 4096
+  };
+
+  FloodFilter(unsigned limit, std::chrono::steady_clock::duration window) :
+    _limit(limit),
+    _window(window),
+    _windowStart(std::chrono::steady_clock::now()),
+    _current(DEPTH * WIDTH),
+    _previous(DEPTH * WIDTH) { }
+
+  bool enabled() const {
+    return _limit > 0;
+  }
+
+  // Counts the line and returns false if it's over the limit.
+  bool admit(const std::string& line) {
+    rotate();
+    uint64_t hash = std::hash<std::string>()(line);
+    // Double hashing: row i uses h1 + i * h2, with h2 odd so rows don't collapse.
+    uint32_t h1 = static_cast<uint32_t>(hash);
+    uint32_t h2 = static_cast<uint32_t>(hash >> 32) | 1;
+    std::array<size_t, DEPTH> slots;
+    uint32_t estimate = UINT32_MAX;
+    for (size_t row = 0; row < DEPTH; ++row) {
+      slots[row] = row * WIDTH + (h1 + row * h2) % WIDTH;
+      estimate = std::min(estimate, uint32_t(_current[slots[row]]) + _previous[slots[row]]);
+    }
+    if (estimate >= _limit) {
+      return false;
+    }
+    uint16_t current = UINT16_MAX;
+    for (size_t slot : slots) {
+      current = std::min(current, _current[slot]);
+    }
+    for (size_t slot : slots) {
+      if (_current[slot] == current) {
+	++_current[slot];
+      }
+    }
+    return true;
+  }
+
+private:
+  void rotate() {
+    auto now = std::chrono::steady_clock::now();
+    if (now - _windowStart < _window) {
+      return;
+    }
+    if (now - _windowStart < 2 * _window) {
+      _previous.swap(_current);
+    }
+    else {
+      std::fill(_previous.begin(), _previous.end(), 0);
+    }
+    std::fill(_current.begin(), _current.end(), 0);
+    _windowStart = now;
+  }
+
+  uint32_t _limit;
+  std::chrono::steady_clock::duration _window;
+  std::chrono::steady_clock::time_point _windowStart;
+  std::vector<uint16_t> _current;
+  std::vector<uint16_t> _previous;
+};
+
+#endif
@@ -0,0 +1,137 @@
+#ifndef LATENCY_HISTOGRAM_HPP
+#define LATENCY_HISTOGRAM_HPP
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <iomanip>
+#include <ostream>
+
+// Log-linear histogram in the spirit of HdrHistogram: values below 2^SUB_BITS are counted
+// exactly, above that every power-of-two range is split into 2^(SUB_BITS-1) equal buckets, so
+// a value is off by at most 1/2^(SUB_BITS-1) (1/64, about 1.6%) over the whole 64-bit range,
+// with ~30kB of counters.
+// Recording is a couple of shifts and an increment. Not thread safe - keep one per thread
+// and merge() at the end.
+class LatencyHistogram {
+public:
+  LatencyHistogram() :
+    _count(0),
+    _sum(0),
+    _min(UINT64_MAX),
+    _max(0) {
+    _buckets.fill(0);
+  }
+
+  void record(uint64_t value) {
+    ++_buckets[bucketIndex(value)];
+    ++_count;
+    _sum += value;
+    _min = std::min(_min, value);
+    _max = std::max(_max, value);
+  }
+
+  void merge(const LatencyHistogram& other) {
+    for (size_t i = 0; i < BUCKETS; ++i) {
+      _buckets[i] += other._buckets[i];
+    }
+    _count += other._count;
+    _sum += other._sum;
+    _min = std::min(_min, other._min);
+    _max = std::max(_max, other._max);
+  }
+
+  void reset() {
+    *this = LatencyHistogram();
+  }
+
+  uint64_t count() const {
+    return _count;
+  }
+
+  uint64_t min() const {
+    return _count ? _min : 0;
+  }
+
+  uint64_t max() const {
+    return _max;
+  }
+
+  double mean() const {
+    return _count ? static_cast<double>(_sum) / _count : 0.0;
+  }
+
+  // Smallest recorded-bucket value v such that at least 'percent'% of samples are <= v.
+  uint64_t percentile(double percent) const {
+    if (_count == 0) {
+      return 0;
+    }
+    uint64_t rank = static_cast<uint64_t>(percent / 100.0 * _count + 0.5);
+    rank = std::max<uint64_t>(1, std::min(rank, _count));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < BUCKETS; ++i) {
+      seen += _buckets[i];
+      if (seen >= rank) {
+	return std::min(bucketUpperBound(i), _max);
+      }
+    }
+    return _max;
+  }
+
+  // Prints the usual percentile ladder; values are divided by 'divisor' (e.g. 1000 for ns -> us).
+  void print(std::ostream& stream, const char* unit, double divisor = 1.0) const {
+    static const struct {
+      double percent;
+      const char* label;
+    } ladder[] = {
+      { 50.0, "p50    " }, { 90.0, "p90    " }, { 99.0, "p99    " },
+      { 99.9, "p99.9  " }, { 99.99, "p99.99 " }
+    };
+    std::ios::fmtflags flags = stream.flags();
+    std::streamsize precision = stream.precision();
+    stream << std::fixed << std::setprecision(1)
+	   << "  samples " << _count << '\n'
+	   << "  min     " << min() / divisor << ' ' << unit << '\n'
+	   << "  mean    " << mean() / divisor << ' ' << unit << '\n';
+    for (const auto& step : ladder) {
+      stream << "  " << step.label << ' ' << percentile(step.percent) / divisor << ' ' << unit << '\n';
+    }
+    stream << "  max     " << _max / divisor << ' ' << unit << '\n';
+    stream.flags(flags);
+    stream.precision(precision);
+  }
+
+private:
+  enum {
+    SUB_BITS = 7,
+    SUB_COUNT = 1 << SUB_BITS,
+    HALF_COUNT = SUB_COUNT / 2,
+    BUCKETS = SUB_COUNT + (64 - SUB_BITS) * HALF_COUNT
+  };
+
+  static size_t bucketIndex(uint64_t value) {
+    if (value < SUB_COUNT) {
+      return value;
+    }
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - (SUB_BITS - 1);
+    return SUB_COUNT + (shift - 1) * HALF_COUNT + ((value >> shift) - HALF_COUNT);
+  }
+
+  static uint64_t bucketUpperBound(size_t index) {
+    if (index < SUB_COUNT) {
+      return index;
+    }
+    size_t shift = (index - SUB_COUNT) / HALF_COUNT + 1;
+    uint64_t sub = (index - SUB_COUNT) % HALF_COUNT + HALF_COUNT;
+    return ((sub + 1) << shift) - 1;
+  }
+
+  std::array<uint64_t, BUCKETS> _buckets;
+  uint64_t _count;
+  uint64_t _sum;
+  uint64_t _min;
+  uint64_t _max;
+};
+
+#endif
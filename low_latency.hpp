@@ -0,0 +1,93 @@
+#ifndef LOW_LATENCY_HPP
+#define LOW_LATENCY_HPP
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/socket.h>
+
+#include <atomic>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+
+#ifndef SO_BUSY_POLL
+#define SO_BUSY_POLL 46
+#endif
+
+// Parses CPU lists in the format used by taskset and /sys: "2", "0,2,4", "8-11,16".
+inline std::vector<int> parseCpuList(const std::string& list) {
+  std::vector<int> cpus;
+  size_t pos = 0;
+  while (pos < list.size()) {
+    size_t end = list.find(',', pos);
+    if (end == std::string::npos) {
+      end = list.size();
+    }
+    std::string range = list.substr(pos, end - pos);
+    size_t dash = range.find('-');
+    int first = std::stoi(range.substr(0, dash));
+    int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+    if (first < 0 || last < first) {
+      throw std::invalid_argument("invalid CPU range: " + range);
+    }
+    for (int cpu = first; cpu <= last; ++cpu) {
+      cpus.push_back(cpu);
+    }
+    pos = end + 1;
+  }
+  return cpus;
+}
+
+inline void pinThreadToCpu(pthread_t thread, int cpu) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  int res = pthread_setaffinity_np(thread, sizeof(set), &set);
+  if (res != 0) {
+    throw std::system_error(res, std::system_category(), "pthread_setaffinity_np");
+  }
+}
+
+inline void pinCurrentThreadToCpu(int cpu) {
+  pinThreadToCpu(pthread_self(), cpu);
+}
+
+// Makes blocking reads and epoll on this socket spin in the driver for up to 'usec'
+// microseconds before sleeping. Raising the value above net.core.busy_read needs CAP_NET_ADMIN,
+// so failure is not fatal - we just keep the default behaviour.
+inline bool enableBusyPoll(int fd, int usec) {
+  return setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &usec, sizeof(usec)) == 0;
+}
+
+// Hands out CPUs from the configured list in round-robin order. Empty list means "don't pin".
+class CpuAssigner {
+public:
+  explicit CpuAssigner(const std::vector<int>& cpus) :
+    _cpus(cpus),
+    _next(0) { }
+
+  bool enabled() const {
+    return ! _cpus.empty();
+  }
+
+  int next() {
+    return _cpus[_next++ % _cpus.size()];
+  }
+
+private:
+  std::vector<int> _cpus;
+  std::atomic<size_t> _next;
+};
+
+// Replacement for io_service::run() that never sleeps in epoll_wait: it keeps calling poll()
+// until the io_service runs out of work or gets stopped. Burns the whole core, so it only makes
+// sense together with pinning.
+template <class IoService>
+void runSpinning(IoService& ioService) {
+  while (! ioService.stopped()) {
+    ioService.poll();
+  }
+}
+
+#endif
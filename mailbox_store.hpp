@@ -0,0 +1,343 @@
+#ifndef MAILBOX_STORE_HPP
+#define MAILBOX_STORE_HPP
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Messages for users who are offline, kept until they log in.
+//
+// The mailboxes live in memory, bounded to MAILBOX_LIMIT messages and MAILBOX_BYTES each (the
+// oldest are dropped) and to MAX_MAILBOXES names, and are made durable by an append-only log
+// of DEPOSIT and ACK records:
+//   type (1 byte), name length, name, [message length, message | acknowledged count]
+// with LEB128 lengths. deposit() and ack() only update the map and queue the encoded record;
+// a background thread appends the queue to the file, so chat threads never wait for the disk.
+// The log is rewritten with just the undelivered messages on startup, and by the background
+// thread once dropped and delivered records outweigh them by COMPACT_BYTES.
+//
+// Delivery is peek, write, ack: peek() leaves the messages in place, and only ack() after the
+// write went through removes them, so mail sent to a client that disconnects while logging in
+// stays for the next login.
+class MailboxStore {
+public:
+  enum {
+    MAILBOX_LIMIT = 100,
+    MAILBOX_BYTES = 64 * 1024,
+    MAX_MAILBOXES = 10000,
+    MESSAGE_LIMIT = 4096,
+    COMPACT_BYTES = 1 << 20
+  };
+
+  typedef std::vector<std::shared_ptr<std::string> > Messages;
+
+  explicit MailboxStore(const std::string& path) :
+    _path(path),
+    _liveBytes(0),
+    _logBytes(0),
+    _stopping(false) {
+    load();
+    compact();
+    _file.open(path, std::ios::binary | std::ios::app);
+    if (! _file) {
+      throw std::runtime_error("can't open mailbox store " + path);
+    }
+    _writer = std::thread(std::bind(&MailboxStore::writerThread, this));
+  }
+
+  ~MailboxStore() {
+    {
+      std::lock_guard<std::mutex> guard(_mutex);
+      _stopping = true;
+    }
+    _writerCondition.notify_one();
+    _writer.join();
+  }
+
+  // False if the message is refused: longer than MESSAGE_LIMIT, or for a new name while
+  // MAX_MAILBOXES are in use.
+  bool deposit(const std::string& name, const std::string& msg) {
+    std::lock_guard<std::mutex> guard(_mutex);
+    if (! applyDeposit(name, msg)) {
+      return false;
+    }
+    log(DEPOSIT, name, msg);
+    return true;
+  }
+
+  // The mailbox's messages, oldest first, left in place until ack().
+  Messages peek(const std::string& name) {
+    std::lock_guard<std::mutex> guard(_mutex);
+    auto found = _mailboxes.find(name);
+    if (found == _mailboxes.end()) {
+      return Messages();
+    }
+    return Messages(found->second.messages.begin(), found->second.messages.end());
+  }
+
+  // Removes messages returned by peek() once they have been delivered. Deposits since only
+  // add at the back and drops only remove at the front, so those still there lead the mailbox.
+  void ack(const std::string& name, const Messages& delivered) {
+    std::lock_guard<std::mutex> guard(_mutex);
+    auto found = _mailboxes.find(name);
+    if (found == _mailboxes.end()) {
+      return;
+    }
+    auto& messages = found->second.messages;
+    size_t count = 0;
+    while (count < messages.size() &&
+	   std::find(delivered.begin(), delivered.end(), messages[count]) != delivered.end()) {
+      ++count;
+    }
+    if (count == 0) {
+      return;
+    }
+    applyAck(found, count);
+    std::string countText;
+    appendVarint(countText, count);
+    log(ACK, name, countText);
+  }
+
+private:
+  enum RecordType {
+    DEPOSIT = 1,
+    ACK = 2
+  };
+
+  struct Mailbox {
+    std::deque<std::shared_ptr<std::string> > messages;
+    size_t bytes = 0;
+  };
+
+  typedef std::map<std::string, Mailbox> Mailboxes;
+
+  static size_t varintSize(uint64_t value) {
+    size_t size = 1;
+    while (value >= 0x80) {
+      value >>= 7;
+      ++size;
+    }
+    return size;
+  }
+
+  // What a message's DEPOSIT record takes in the log.
+  static size_t depositSize(const std::string& name, const std::string& msg) {
+    return 1 + varintSize(name.size()) + name.size() + varintSize(msg.size()) + msg.size();
+  }
+
+  bool applyDeposit(const std::string& name, const std::string& msg) {
+    if (name.size() > MESSAGE_LIMIT || msg.size() > MESSAGE_LIMIT) {
+      return false;
+    }
+    auto found = _mailboxes.find(name);
+    if (found == _mailboxes.end()) {
+      if (_mailboxes.size() >= MAX_MAILBOXES) {
+	return false;
+      }
+      found = _mailboxes.emplace(name, Mailbox()).first;
+    }
+    Mailbox& mailbox = found->second;
+    mailbox.messages.push_back(std::make_shared<std::string>(msg));
+    mailbox.bytes += msg.size();
+    _liveBytes += depositSize(name, msg);
+    while (mailbox.messages.size() > MAILBOX_LIMIT || mailbox.bytes > MAILBOX_BYTES) {
+      dropOldest(found);
+    }
+    return true;
+  }
+
+  void dropOldest(Mailboxes::iterator mailbox) {
+    const std::string& msg = *mailbox->second.messages.front();
+    mailbox->second.bytes -= msg.size();
+    _liveBytes -= depositSize(mailbox->first, msg);
+    mailbox->second.messages.pop_front();
+  }
+
+  void applyAck(Mailboxes::iterator mailbox, size_t count) {
+    while (count-- > 0 && ! mailbox->second.messages.empty()) {
+      dropOldest(mailbox);
+    }
+    if (mailbox->second.messages.empty()) {
+      _mailboxes.erase(mailbox);
+    }
+  }
+
+  void log(RecordType type, const std::string& name, const std::string& payload) {
+    size_t before = _pending.size();
+    appendRecord(_pending, type, name, payload);
+    _logBytes += _pending.size() - before;
+    _writerCondition.notify_one();
+  }
+
+  static void appendVarint(std::string& out, uint64_t value) {
+    while (value >= 0x80) {
+      out.push_back(static_cast<char>(value | 0x80));
+      value >>= 7;
+    }
+    out.push_back(static_cast<char>(value));
+  }
+
+  // DEPOSIT payloads are length-prefixed messages; ACK payloads are the encoded count.
+  static void appendRecord(std::string& out, RecordType type, const std::string& name,
+			   const std::string& payload) {
+    out.push_back(static_cast<char>(type));
+    appendVarint(out, name.size());
+    out += name;
+    if (type == DEPOSIT) {
+      appendVarint(out, payload.size());
+    }
+    out += payload;
+  }
+
+  static bool readVarint(std::istream& in, uint64_t& value) {
+    value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      int byte = in.get();
+      if (byte == std::char_traits<char>::eof()) {
+	return false;
+      }
+      value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      if (! (byte & 0x80)) {
+	return true;
+      }
+    }
+    return false;
+  }
+
+  // Lengths above MESSAGE_LIMIT can only come from a corrupt log.
+  static bool readString(std::istream& in, std::string& value) {
+    uint64_t size;
+    if (! readVarint(in, size) || size > MESSAGE_LIMIT) {
+      return false;
+    }
+    value.resize(size);
+    return size == 0 || in.read(&value[0], size);
+  }
+
+  // A missing file is an empty store; a record cut short by a crash, or corrupt, ends the log.
+  void load() {
+    std::ifstream in(_path, std::ios::binary);
+    std::string name;
+    std::string msg;
+    uint64_t count;
+    while (in) {
+      int type = in.get();
+      if (type == std::char_traits<char>::eof() ||
+	  (type != DEPOSIT && type != ACK) || ! readString(in, name)) {
+	break;
+      }
+      if (type == DEPOSIT) {
+	if (! readString(in, msg)) {
+	  break;
+	}
+	applyDeposit(name, msg);
+	continue;
+      }
+      if (! readVarint(in, count)) {
+	break;
+      }
+      auto found = _mailboxes.find(name);
+      if (found != _mailboxes.end()) {
+	applyAck(found, count);
+      }
+    }
+  }
+
+  std::string snapshot() const {
+    std::string contents;
+    for (const auto& mailbox : _mailboxes) {
+      for (const auto& msg : mailbox.second.messages) {
+	appendRecord(contents, DEPOSIT, mailbox.first, *msg);
+      }
+    }
+    return contents;
+  }
+
+  void compact() {
+    std::string contents = snapshot();
+    _logBytes = contents.size();
+    replaceFile(contents);
+  }
+
+  void replaceFile(const std::string& contents) {
+    std::string tmpPath = _path + ".tmp";
+    {
+      std::ofstream out(tmpPath, std::ios::binary | std::ios::trunc);
+      if (! out.write(contents.data(), contents.size()) || ! out.flush()) {
+	throw std::runtime_error("can't write mailbox store " + tmpPath);
+      }
+    }
+    if (std::rename(tmpPath.c_str(), _path.c_str()) != 0) {
+      throw std::runtime_error("can't replace mailbox store " + _path);
+    }
+  }
+
+  // Records still queued are already in the mailboxes, so a snapshot taken under the lock
+  // stands for them and for the whole file.
+  void writerThread() {
+    std::string batch;
+    std::string contents;
+    std::unique_lock<std::mutex> lock(_mutex);
+    while (true) {
+      _writerCondition.wait(lock, [this]() { return _stopping || ! _pending.empty(); });
+      batch.swap(_pending);
+      bool stopping = _stopping;
+      size_t dead = _logBytes - _liveBytes;
+      size_t fileBytes = _logBytes - batch.size();
+      bool compacting = dead > COMPACT_BYTES && dead > _liveBytes;
+      if (compacting) {
+	contents = snapshot();
+	_logBytes = contents.size() + _pending.size();
+      }
+      lock.unlock();
+      if (compacting) {
+	try {
+	  replaceFile(contents);
+	  _file.close();
+	  _file.open(_path, std::ios::binary | std::ios::app);
+	  batch.clear();
+	}
+	catch (std::exception& ex) {
+	  // The old log is intact: keep appending to it.
+	  std::cerr << "Mailbox compaction failed: " << ex.what() << std::endl;
+	  lock.lock();
+	  _logBytes += fileBytes + batch.size() - contents.size();
+	  lock.unlock();
+	}
+	contents.clear();
+      }
+      _file.write(batch.data(), batch.size());
+      _file.flush();
+      batch.clear();
+      if (stopping) {
+	return;
+      }
+      lock.lock();
+    }
+  }
+
+  std::string _path;
+  std::mutex _mutex;
+  Mailboxes _mailboxes;
+  size_t _liveBytes;  // DEPOSIT records of the messages still in _mailboxes
+  size_t _logBytes;  // the file plus _pending
+  std::string _pending;
+  std::ofstream _file;
+  std::condition_variable _writerCondition;
+  bool _stopping;
+  std::thread _writer;
+};
+
+#endif
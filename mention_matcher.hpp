@@ -0,0 +1,184 @@
+#ifndef MENTION_MATCHER_HPP
+#define MENTION_MATCHER_HPP
+
+#include <algorithm>
+#include <cctype>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Aho-Corasick automaton over "@name" for every name online, so a chat line is scanned for
+// mentions of all users at once in time linear in the line length.
+//
+// The trie is maintained incrementally: add() inserts the name's path, remove() only clears
+// its terminal mark. Failure and output links are rebuilt lazily by the first scan() after an
+// add(); removals need no rebuild because matches are checked against the terminal mark.
+// When more than half the nodes belong to names that left, the next scan() prunes the trie.
+class MentionMatcher {
+public:
+  MentionMatcher() :
+    _nodes(1),
+    _liveNames(0),
+    _deadNames(0),
+    _dirty(false) { }
+
+  void add(const std::string& name) {
+    int32_t node = 0;
+    node = descend(node, '@', true);
+    for (char c : name) {
+      node = descend(node, static_cast<unsigned char>(c), true);
+    }
+    if (! _nodes[node].terminal) {
+      _nodes[node].terminal = true;
+      ++_liveNames;
+      _dirty = true;
+    }
+  }
+
+  void remove(const std::string& name) {
+    int32_t node = descend(0, '@', false);
+    for (size_t i = 0; i < name.size() && node > 0; ++i) {
+      node = descend(node, static_cast<unsigned char>(name[i]), false);
+    }
+    if (node > 0 && _nodes[node].terminal) {
+      _nodes[node].terminal = false;
+      --_liveNames;
+      ++_deadNames;
+    }
+  }
+
+  // Appends every distinct online name mentioned in 'text' to 'mentions'. A mention is "@name"
+  // not preceded by a word character and not followed by one, so "@bob" doesn't fire for
+  // "@bobby" or "mail@bob".
+  void scan(const std::string& text, std::vector<std::string>& mentions) {
+    if (_liveNames == 0 || std::memchr(text.data(), '@', text.size()) == nullptr) {
+      return;
+    }
+    if (_deadNames > _liveNames) {
+      prune();
+    }
+    if (_dirty) {
+      buildLinks();
+    }
+
+    int32_t state = 0;
+    for (size_t i = 0; i < text.size(); ++i) {
+      state = step(state, static_cast<unsigned char>(text[i]));
+      for (int32_t node = state; node > 0; node = _nodes[node].output) {
+	if (! _nodes[node].terminal || (i + 1 < text.size() && isWordChar(text[i + 1]))) {
+	  continue;
+	}
+	size_t at = i + 1 - _nodes[node].depth;
+	if (at > 0 && isWordChar(text[at - 1])) {
+	  continue;
+	}
+	std::string name = text.substr(at + 1, _nodes[node].depth - 1);
+	if (std::find(mentions.begin(), mentions.end(), name) == mentions.end()) {
+	  mentions.push_back(std::move(name));
+	}
+      }
+    }
+  }
+
+private:
+  struct Node {
+    std::vector<std::pair<unsigned char, int32_t> > children;  // sorted by character
+    int32_t fail = 0;
+    int32_t output = 0;  // nearest node on the failure chain that ends a name, 0 if none
+    uint32_t depth = 0;
+    bool terminal = false;
+  };
+
+  static bool isWordChar(char c) {
+    return std::isalnum(static_cast<unsigned char>(c)) || c == '_';
+  }
+
+  int32_t child(int32_t node, unsigned char c) const {
+    const auto& children = _nodes[node].children;
+    auto found = std::lower_bound(children.begin(), children.end(), std::make_pair(c, INT32_MIN));
+    return found != children.end() && found->first == c ? found->second : -1;
+  }
+
+  // Returns the child for 'c', creating it if asked to; -1 if it doesn't exist.
+  int32_t descend(int32_t node, unsigned char c, bool create) {
+    int32_t next = child(node, c);
+    if (next >= 0 || ! create) {
+      return next;
+    }
+    next = static_cast<int32_t>(_nodes.size());
+    _nodes.emplace_back();
+    _nodes[next].depth = _nodes[node].depth + 1;
+    auto& children = _nodes[node].children;
+    children.insert(std::lower_bound(children.begin(), children.end(), std::make_pair(c, INT32_MIN)),
+		    std::make_pair(c, next));
+    return next;
+  }
+
+  int32_t step(int32_t state, unsigned char c) const {
+    while (true) {
+      int32_t next = child(state, c);
+      if (next >= 0) {
+	return next;
+      }
+      if (state == 0) {
+	return 0;
+      }
+      state = _nodes[state].fail;
+    }
+  }
+
+  void buildLinks() {
+    std::deque<int32_t> queue;
+    for (const auto& edge : _nodes[0].children) {
+      _nodes[edge.second].fail = 0;
+      _nodes[edge.second].output = 0;
+      queue.push_back(edge.second);
+    }
+    while (! queue.empty()) {
+      int32_t node = queue.front();
+      queue.pop_front();
+      for (const auto& edge : _nodes[node].children) {
+	int32_t fail = step(_nodes[node].fail, edge.first);
+	Node& next = _nodes[edge.second];
+	next.fail = fail;
+	next.output = _nodes[fail].terminal ? fail : _nodes[fail].output;
+	queue.push_back(edge.second);
+      }
+    }
+    _dirty = false;
+  }
+
+  // Rebuilds the trie from the names still online.
+  void prune() {
+    std::vector<std::string> names;
+    std::string path;
+    collect(0, path, names);
+    _nodes.assign(1, Node());
+    _liveNames = _deadNames = 0;
+    for (const auto& name : names) {
+      add(name.substr(1));
+    }
+    _dirty = true;
+  }
+
+  void collect(int32_t node, std::string& path, std::vector<std::string>& names) const {
+    if (_nodes[node].terminal) {
+      names.push_back(path);
+    }
+    for (const auto& edge : _nodes[node].children) {
+      path.push_back(static_cast<char>(edge.first));
+      collect(edge.second, path, names);
+      path.pop_back();
+    }
+  }
+
+  std::vector<Node> _nodes;
+  size_t _liveNames;
+  size_t _deadNames;
+  bool _dirty;
+};
+
+#endif
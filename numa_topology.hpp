@@ -0,0 +1,96 @@
+#ifndef NUMA_TOPOLOGY_HPP
+#define NUMA_TOPOLOGY_HPP
+
+#include "low_latency.hpp"
+
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef SO_INCOMING_CPU
+#define SO_INCOMING_CPU 49
+#endif
+
+struct NumaNode {
+  int id;
+  std::vector<int> cpus;
+};
+
+// Reads the online nodes from sysfs; their ids need not be contiguous (e.g. "0,2-3" after a
+// node went offline). Machines (or containers) without it are reported as a single node holding
+// every CPU, so callers never have to special-case UMA.
+inline std::vector<NumaNode> readNumaTopology() {
+  std::vector<NumaNode> nodes;
+  std::string online;
+  std::ifstream onlineFile("/sys/devices/system/node/online");
+  std::getline(onlineFile, online);
+  for (int id : parseCpuList(online)) {
+    std::ifstream file("/sys/devices/system/node/node" + std::to_string(id) + "/cpulist");
+    std::string cpuList;
+    std::getline(file, cpuList);
+    if (! cpuList.empty()) {
+      nodes.push_back(NumaNode{id, parseCpuList(cpuList)});
+    }
+  }
+  if (nodes.empty()) {
+    NumaNode node{0, {}};
+    for (unsigned cpu = 0; cpu < std::max(1u, std::thread::hardware_concurrency()); ++cpu) {
+      node.cpus.push_back(cpu);
+    }
+    nodes.push_back(node);
+  }
+  return nodes;
+}
+
+// Returns index into 'nodes' of the node owning 'cpu', or -1.
+inline int findNumaNodeOfCpu(const std::vector<NumaNode>& nodes, int cpu) {
+  for (size_t i = 0; i < nodes.size(); ++i) {
+    const auto& cpus = nodes[i].cpus;
+    if (std::find(cpus.begin(), cpus.end(), cpu) != cpus.end()) {
+      return static_cast<int>(i);
+    }
+  }
+  return -1;
+}
+
+// Restricts the calling thread to the node's CPUs and makes the node its preferred memory
+// source, so everything the thread allocates from now on (including coroutine stacks and
+// socket objects) lands in node-local memory on first touch.
+inline void bindCurrentThreadToNumaNode(const NumaNode& node) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : node.cpus) {
+    CPU_SET(cpu, &set);
+  }
+  int res = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+  if (res != 0) {
+    throw std::system_error(res, std::system_category(), "pthread_setaffinity_np");
+  }
+
+  unsigned long nodeMask[4] = { 0 };
+  const size_t bitsPerWord = 8 * sizeof(nodeMask[0]);
+  if (node.id < static_cast<int>(sizeof(nodeMask) * 8)) {
+    nodeMask[node.id / bitsPerWord] |= 1ul << (node.id % bitsPerWord);
+    // Failure here (e.g. seccomp in containers) only costs locality, not correctness.
+    syscall(SYS_set_mempolicy, MPOL_PREFERRED, nodeMask, sizeof(nodeMask) * 8);
+  }
+}
+
+// CPU on which the kernel processed the most recent packets of this socket - i.e. the CPU
+// handling the NIC queue interrupt for the flow. Returns -1 if the kernel doesn't know yet.
+inline int getIncomingCpu(int fd) {
+  int cpu = -1;
+  socklen_t len = sizeof(cpu);
+  if (getsockopt(fd, SOL_SOCKET, SO_INCOMING_CPU, &cpu, &len) < 0) {
+    return -1;
+  }
+  return cpu;
+}
+
+#endif
@@ -1,5 +1,9 @@
+#include <algorithm>
 #include <iostream>
 #include <array>
+#include <new>
+#include <tuple>
+#include <type_traits>
 #include <assert.h>
 
 enum ObjectId {
@@ -66,31 +70,328 @@ struct ObjectPoolImpl<T, BEGIN, END, IDX, true> : public ObjectPoolImpl<T, BEGIN
   }
 };
 
+// Every object built with the pool, by the ObjectPoolImpl chain above.
 template <class T, size_t BEGIN, size_t END>
+struct EagerStorage {
+  static constexpr bool lazy = false;
+
+  ObjectPoolImpl<T, BEGIN, END, 0> _impl;
+  std::array<T*, END - BEGIN> _byIndex;
+
+  EagerStorage() {
+    _impl.fillStack(_byIndex);
+  }
+
+  size_t constructed() const {
+    return END - BEGIN;
+  }
+
+  T* find(size_t index) {
+    return _byIndex[index];
+  }
+};
+
+// Raw slots, each constructed when the pool first hands it out, in id order. A large pool of
+// which little is used costs neither the constructors nor the pages of the rest.
+template <class T, size_t BEGIN, size_t END>
+struct LazyStorage {
+  static constexpr bool lazy = true;
+
+  typename std::aligned_storage<sizeof(T), alignof(T)>::type _slots[END - BEGIN];
+  size_t _constructed = 0;
+
+  LazyStorage() = default;
+  LazyStorage(const LazyStorage&) = delete;
+  LazyStorage& operator=(const LazyStorage&) = delete;
+
+  ~LazyStorage() {
+    while (_constructed > 0) {
+      slot(--_constructed)->~T();
+    }
+  }
+
+  size_t constructed() const {
+    return _constructed;
+  }
+
+  T* construct() {
+    assert(_constructed < END - BEGIN);
+    T* obj = new (&_slots[_constructed]) T(static_cast<ObjectId>(BEGIN + _constructed));
+    ++_constructed;
+    return obj;
+  }
+
+  T* find(size_t index) {
+    return index < _constructed ? slot(index) : NULL;
+  }
+
+private:
+  T* slot(size_t index) {
+    return reinterpret_cast<T*>(&_slots[index]);
+  }
+};
+
+// Customization point: what an object coming back to its pool goes through before the pool
+// hands it out again. It is reset in place, not destroyed and rebuilt; by default it is left
+// as it is.
+template <class T>
+struct PoolReset {
+  static void reset(T&) { }
+};
+
+template <class T, size_t BEGIN, size_t END,
+	  template <class, size_t, size_t> class Storage = EagerStorage>
 struct ObjectPool {
+  typedef T value_type;
+  static const size_t BEGIN_ID = BEGIN;
+  static const size_t END_ID = END;
   static const size_t COUNT = END - BEGIN;
 
-  ObjectPoolImpl<T, BEGIN, END, 0> _impl;
+  // _stack[0, _stackPtr) are out, _stack[_stackPtr, constructed) are free, the rest not built.
+  Storage<T, BEGIN, END> _storage;
   std::array<T*, COUNT> _stack;
   size_t _stackPtr = 0;
 
   ObjectPool() {
-    _impl.fillStack(_stack);
+    for (size_t i = 0; i < _storage.constructed(); ++i) {
+      _stack[i] = _storage.find(i);
+    }
+  }
+
+  static constexpr bool owns(size_t id) {
+    return BEGIN <= id && id < END;
+  }
+
+  // The object with this id, or NULL if it hasn't been constructed yet.
+  T* find(size_t id) {
+    assert(owns(id));
+    return _storage.find(id - BEGIN);
   }
 
   T* pop() {
-    return _stackPtr < COUNT ? _stack[_stackPtr++] : NULL;
+    if (_stackPtr == COUNT) {
+      return NULL;
+    }
+    constructUpTo(_stackPtr + 1, Lazy());
+    return _stack[_stackPtr++];
   }
 
+  // Returns the object popped last.
   void push() {
     assert(_stackPtr > 0);
-    --_stackPtr;
+    PoolReset<T>::reset(*_stack[--_stackPtr]);
+  }
+
+  void push(T* obj) {
+    assert(_stackPtr > 0 && owns(obj->_id));
+    PoolReset<T>::reset(*obj);
+    _stack[--_stackPtr] = obj;
+  }
+
+  // Batches move the stack pointer once: pop_n() takes up to n objects into out and returns
+  // how many it took, push_n() gives n popped objects back.
+  size_t pop_n(T** out, size_t n) {
+    n = std::min(n, COUNT - _stackPtr);
+    constructUpTo(_stackPtr + n, Lazy());
+    std::copy(_stack.begin() + _stackPtr, _stack.begin() + _stackPtr + n, out);
+    _stackPtr += n;
+    return n;
+  }
+
+  void push_n(T* const* objs, size_t n) {
+    assert(n <= _stackPtr);
+    _stackPtr -= n;
+    for (size_t i = 0; i < n; ++i) {
+      assert(owns(objs[i]->_id));
+      PoolReset<T>::reset(*objs[i]);
+      _stack[_stackPtr + i] = objs[i];
+    }
+  }
+
+private:
+  typedef std::integral_constant<bool, Storage<T, BEGIN, END>::lazy> Lazy;
+
+  // Makes sure the first count objects exist; an eager storage built them all up front.
+  void constructUpTo(size_t count, std::true_type) {
+    while (_storage.constructed() < count) {
+      _stack[_storage.constructed()] = _storage.construct();
+    }
+  }
+
+  void constructUpTo(size_t, std::false_type) { }
+};
+
+template <class... Pools>
+constexpr bool idRangesDisjoint() {
+  const size_t begins[] = { Pools::BEGIN_ID... };
+  const size_t ends[] = { Pools::END_ID... };
+  for (size_t i = 0; i < sizeof...(Pools); ++i) {
+    for (size_t j = i + 1; j < sizeof...(Pools); ++j) {
+      if (begins[i] < ends[j] && begins[j] < ends[i]) {
+	return false;
+      }
+    }
+  }
+  return true;
+}
+
+template <class... Pools>
+constexpr size_t idLimit() {
+  const size_t ends[] = { Pools::END_ID... };
+  size_t limit = 0;
+  for (size_t end : ends) {
+    limit = end > limit ? end : limit;
+  }
+  return limit;
+}
+
+// Which pool owns each id below LIMIT; ids no pool owns map to the pool count.
+template <size_t LIMIT>
+struct PoolIndexTable {
+  unsigned char _index[LIMIT];
+};
+
+template <class... Pools>
+constexpr PoolIndexTable<idLimit<Pools...>()> makePoolIndexTable() {
+  const size_t begins[] = { Pools::BEGIN_ID... };
+  const size_t ends[] = { Pools::END_ID... };
+  PoolIndexTable<idLimit<Pools...>()> table{};
+  for (size_t id = 0; id < idLimit<Pools...>(); ++id) {
+    table._index[id] = sizeof...(Pools);
+  }
+  for (size_t pool = 0; pool < sizeof...(Pools); ++pool) {
+    for (size_t id = begins[pool]; id < ends[pool]; ++id) {
+      table._index[id] = pool;
+    }
+  }
+  return table;
+}
+
+// The pools of a program, one per object type. Their id ranges are checked not to overlap at
+// compile time, which also builds the table from id to pool, so resolving an id is an index
+// into that table and one into the pool: no hashing, no search over the pools.
+template <class... Pools>
+struct PoolRegistry {
+  static const size_t POOL_COUNT = sizeof...(Pools);
+  static const size_t ID_LIMIT = idLimit<Pools...>();
+
+  static_assert(idRangesDisjoint<Pools...>(), "object pools have overlapping id ranges");
+  static_assert(POOL_COUNT < 255, "pool indices are stored in bytes");
+
+  std::tuple<Pools...> _pools;
+  static constexpr PoolIndexTable<ID_LIMIT> _poolIndex = makePoolIndexTable<Pools...>();
+
+  // Index of the pool owning id, in template argument order, or POOL_COUNT if none does.
+  static size_t poolOf(size_t id) {
+    return id < ID_LIMIT ? _poolIndex._index[id] : POOL_COUNT;
+  }
+
+  template <class T>
+  static constexpr size_t poolFor() {
+    const bool matches[] = { std::is_same<T, typename Pools::value_type>::value... };
+    for (size_t i = 0; i < POOL_COUNT; ++i) {
+      if (matches[i]) {
+	return i;
+      }
+    }
+    return POOL_COUNT;
+  }
+
+  template <class T>
+  typename std::tuple_element<poolFor<T>(), std::tuple<Pools...> >::type& pool() {
+    return std::get<poolFor<T>()>(_pools);
+  }
+
+  // The T with this id, or NULL if the id doesn't belong to T's pool or the object hasn't been
+  // constructed.
+  template <class T>
+  T* find(size_t id) {
+    return poolOf(id) == poolFor<T>() ? pool<T>().find(id) : NULL;
+  }
+
+  // Calls f with a pointer to the object with this id, typed by its pool; returns false if no
+  // pool owns the id or the object hasn't been constructed.
+  template <class F>
+  bool visit(size_t id, F&& f) {
+    typedef bool (*Visitor)(PoolRegistry&, size_t, F&);
+    static const Visitor visitors[] = { &visitIn<typename Pools::value_type, F>... };
+    size_t pool = poolOf(id);
+    return pool != POOL_COUNT && visitors[pool](*this, id, f);
+  }
+
+private:
+  template <class T, class F>
+  static bool visitIn(PoolRegistry& registry, size_t id, F& f) {
+    T* obj = registry.pool<T>().find(id);
+    if (obj) {
+      f(obj);
+    }
+    return obj != NULL;
+  }
+};
+
+template <class... Pools>
+constexpr PoolIndexTable<PoolRegistry<Pools...>::ID_LIMIT> PoolRegistry<Pools...>::_poolIndex;
+
+template <>
+struct PoolReset<Rectangle> {
+  static void reset(Rectangle& rectangle) {
+    rectangle._lowerLeft = rectangle._upperRight = Point{ 0, 0 };
   }
 };
 
 int main() {
-  ObjectPool<Circle, CIRCLE_BEGIN, CIRCLE_END> circles;
-  ObjectPool<Rectangle, RECTANGLE_BEGIN, RECTANGLE_END> rectangles;
+  PoolRegistry<ObjectPool<Circle, CIRCLE_BEGIN, CIRCLE_END>,
+	       ObjectPool<Rectangle, RECTANGLE_BEGIN, RECTANGLE_END, LazyStorage> > pools;
+
+  // Checked in release builds too, where assert() is compiled out.
+  Rectangle* rectangle = pools.pool<Rectangle>().pop();
+  if (pools.find<Rectangle>(rectangle->_id) != rectangle ||
+      pools.find<Circle>(rectangle->_id) != NULL ||
+      pools.poolOf(CIRCLE_BEGIN) != 0 || pools.poolOf(RECTANGLE_END) != pools.POOL_COUNT) {
+    std::cerr << "registry lookup failed" << std::endl;
+    return 1;
+  }
+  if (pools.find<Rectangle>(rectangle->_id + 1) != NULL) {
+    std::cerr << "lazy pool constructed a rectangle not yet handed out" << std::endl;
+    return 1;
+  }
+
+  struct Describe {
+    void operator()(Circle* circle) const {
+      std::cout << "circle " << circle->_id << std::endl;
+    }
+    void operator()(Rectangle* rectangle) const {
+      std::cout << "rectangle " << rectangle->_id << std::endl;
+    }
+  };
+  pools.visit(CIRCLE_BEGIN + 42, Describe());
+  pools.visit(rectangle->_id, Describe());
+  rectangle->_upperRight = Point{ 2, 1 };
+  pools.pool<Rectangle>().push(rectangle);
+  Rectangle* again = pools.pool<Rectangle>().pop();
+  if (again != rectangle || again->_upperRight._x != 0) {
+    std::cerr << "rectangle was not reset on its way back to the pool" << std::endl;
+    return 1;
+  }
+  pools.pool<Rectangle>().push();
+
+  std::array<Rectangle*, 8> batch;
+  size_t taken = pools.pool<Rectangle>().pop_n(batch.data(), batch.size());
+  if (taken != batch.size() || pools.find<Rectangle>(batch.back()->_id) != batch.back()) {
+    std::cerr << "pop_n took " << taken << " of " << batch.size() << " rectangles" << std::endl;
+    return 1;
+  }
+  pools.pool<Rectangle>().push_n(batch.data(), taken);
+
+  std::array<Circle*, CIRCLE_END - CIRCLE_BEGIN + 1> circles;
+  taken = pools.pool<Circle>().pop_n(circles.data(), circles.size());
+  if (taken != CIRCLE_END - CIRCLE_BEGIN || pools.pool<Circle>().pop() != NULL) {
+    std::cerr << "pop_n took " << taken << " circles, the pool has "
+	      << CIRCLE_END - CIRCLE_BEGIN << std::endl;
+    return 1;
+  }
+  pools.pool<Circle>().push_n(circles.data(), taken);
 
   return 0;
 }
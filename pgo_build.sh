@@ -0,0 +1,85 @@
+#!/bin/sh
+# Profile-guided build: builds a plain Release tree and an instrumented one, trains the
+# instrumented binaries on the echo and chat load generators and the spelling benchmark,
+# rebuilds that tree with the profiles and LTO, then runs the same workload on the plain and
+# optimized binaries so their numbers can be compared.
+# Usage: pgo_build.sh [build_root]
+# Environment: PORT, DURATION (seconds per echo run), LINES (chat lines replayed),
+#              DICT (word list for spelling)
+set -e
+SRC=$(cd "$(dirname "$0")" && pwd)
+ROOT=$(mkdir -p "${1:-_pgo}" && cd "${1:-_pgo}" && pwd)
+PORT=${PORT:-7790}
+DURATION=${DURATION:-3}
+LINES=${LINES:-100000}
+DICT=${DICT:-/usr/share/dict/words}
+JOBS=$(nproc)
+
+build() {
+  DIR=$1
+  shift
+  LOG="$ROOT/$DIR.log"
+  if ! { cmake -S "$SRC" -B "$ROOT/$DIR" -DCMAKE_BUILD_TYPE=Release "$@" &&
+         cmake --build "$ROOT/$DIR" -j"$JOBS"; } >"$LOG" 2>&1; then
+    cat "$LOG"
+    exit 1
+  fi
+}
+
+seconds() {
+  date +%s.%N
+}
+
+# Every server is stopped the way that lets it exit normally, so instrumented binaries
+# write their profiles: echo_server on SIGINT, the chat servers by /shutdown at the end of
+# the capture.
+workload() {
+  BIN=$1
+  echo "--- echo_server"
+  "$BIN/echo_server" "$PORT" --threads 2 &
+  SERVER=$!
+  sleep 0.5
+  "$BIN/echo_client" 127.0.0.1 "$PORT" --mode pingpong --connections 16 --threads 2 \
+    --size 64 --duration "$DURATION"
+  "$BIN/echo_client" 127.0.0.1 "$PORT" --mode stream --connections 16 --threads 2 \
+    --size 16384 --duration "$DURATION"
+  kill -INT "$SERVER"
+  wait "$SERVER" || true
+
+  for CHAT in async coroutine threaded; do
+    echo "--- $CHAT"
+    "$BIN/$CHAT" "$PORT" >/dev/null 2>&1 &
+    SERVER=$!
+    sleep 0.5
+    START=$(seconds)
+    "$BIN/replay" "$ROOT/training.cap" 127.0.0.1 "$PORT" --speed 0 | head -1
+    wait "$SERVER" || true
+    echo "server done after $(awk "BEGIN { print $(seconds) - $START }") s"
+  done
+
+  if [ -r "$DICT" ]; then
+    echo "--- spelling"
+    START=$(seconds)
+    "$BIN/spelling" "$DICT" >/dev/null
+    echo "spelling took $(awk "BEGIN { print $(seconds) - $START }") s"
+  else
+    echo "--- spelling skipped: no word list at $DICT"
+  fi
+}
+
+echo "=== building plain and instrumented binaries"
+build plain
+rm -rf "$ROOT/pgo/profiles"
+build pgo -DPGO=GENERATE -DPGO_PROFILE_DIR="$ROOT/pgo/profiles"
+"$ROOT/plain/replay" --generate "$ROOT/training.cap" --lines "$LINES" --shutdown
+
+echo "=== training"
+workload "$ROOT/pgo" >/dev/null
+
+echo "=== building with profiles and LTO"
+build pgo -DPGO=USE -DPGO_PROFILE_DIR="$ROOT/pgo/profiles"
+
+echo "=== plain"
+workload "$ROOT/plain"
+echo "=== PGO+LTO"
+workload "$ROOT/pgo"
@@ -0,0 +1,75 @@
+#ifndef PRESENCE_BATCHER_HPP
+#define PRESENCE_BATCHER_HPP
+
+#include <map>
+#include <string>
+
+// Collects logins and logouts between flushes, so the room gets one presence message per
+// interval instead of one broadcast per event: under a reconnect storm that is O(N) messages
+// per interval rather than O(N^2). A name that both joined and left within the interval
+// cancels out. Up to LISTED_NAMES changes are listed by name, beyond that only counted.
+// Not thread-safe.
+class PresenceBatcher {
+public:
+  enum {
+    LISTED_NAMES = 5
+  };
+
+  void joined(const std::string& name) {
+    change(name, 1);
+  }
+
+  void left(const std::string& name) {
+    change(name, -1);
+  }
+
+  // "*** alice, bob joined; carol left\n" or "*** +12 joined, -7 left\n" for the changes since
+  // the previous call; empty if there were none.
+  std::string flush() {
+    std::string joinedNames;
+    std::string leftNames;
+    size_t joined = 0;
+    size_t left = 0;
+    bool listNames = _changes.size() <= LISTED_NAMES;
+    for (const auto& change : _changes) {
+      ++(change.second > 0 ? joined : left);
+      if (listNames) {
+	std::string& names = change.second > 0 ? joinedNames : leftNames;
+	names += (names.empty() ? "" : ", ") + change.first;
+      }
+    }
+    _changes.clear();
+
+    if (joined + left == 0) {
+      return std::string();
+    }
+    std::string msg = "*** ";
+    if (listNames) {
+      if (joined) {
+	msg += joinedNames + " joined";
+      }
+      if (left) {
+	msg += (joined ? "; " : "") + leftNames + " left";
+      }
+    }
+    else {
+      msg += '+' + std::to_string(joined) + " joined, -" + std::to_string(left) + " left";
+    }
+    return msg + '\n';
+  }
+
+private:
+  void change(const std::string& name, int delta) {
+    auto found = _changes.find(name);
+    if (found == _changes.end()) {
+      _changes.emplace(name, delta);
+    }
+    else if ((found->second += delta) == 0) {
+      _changes.erase(found);
+    }
+  }
+
+  std::map<std::string, int> _changes;
+};
+
+#endif
@@ -0,0 +1,430 @@
+#include <boost/asio.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include "traffic_capture.hpp"
+#include "unix_listener.hpp"
+
+#include <array>
+#include <chrono>
+#include <deque>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <vector>
+
+#include <functional>
+
+using boost::asio::ip::tcp;
+using namespace std::placeholders;
+
+typedef boost::asio::generic::stream_protocol::endpoint StreamEndpoint;
+typedef std::chrono::steady_clock Clock;
+
+struct ReplayStats {
+  uint64_t sessions = 0;
+  uint64_t lines = 0;       // in the capture
+  uint64_t delivered = 0;   // written to the server
+  uint64_t bytesReceived = 0;
+  uint64_t errors = 0;
+  Clock::duration maxLag = Clock::duration::zero();
+};
+
+// One recorded client. Lines sent before the connection is established, or while a previous
+// write is in flight, wait in _output; everything the server sends is read and discarded.
+// Closing only shuts down the sending side: the connection counts as closed, and onClosed
+// runs, once the server has read everything and hung up in turn.
+class ReplayConnection : public std::enable_shared_from_this<ReplayConnection> {
+public:
+  ReplayConnection(boost::asio::io_service& ioService, ReplayStats& stats,
+		   std::function<void()> onClosed) :
+    _socket(ioService),
+    _stats(stats),
+    _onClosed(std::move(onClosed)),
+    _connected(false),
+    _writing(false),
+    _closeRequested(false),
+    _closed(false) { }
+
+  void connect(const StreamEndpoint& endpoint) {
+    _socket.async_connect(endpoint, std::bind(&ReplayConnection::onConnect, shared_from_this(), _1));
+  }
+
+  void send(const std::string& line) {
+    if (_closed) {
+      return;
+    }
+    _output.push_back(line + '\n');
+    startWrite();
+  }
+
+  bool closed() const {
+    return _closed;
+  }
+
+  // Closes once everything queued so far has been written.
+  void close() {
+    _closeRequested = true;
+    if (_connected && ! _writing) {
+      shutdown();
+    }
+  }
+
+private:
+  void onConnect(const boost::system::error_code& error) {
+    if (error) {
+      std::cerr << "Connect error: " << error.message() << std::endl;
+      ++_stats.errors;
+      finish();
+      return;
+    }
+    _connected = true;
+    startRead();
+    startWrite();
+    if (_closeRequested && ! _writing) {
+      shutdown();
+    }
+  }
+
+  void startWrite() {
+    if (! _connected || _writing || _output.empty()) {
+      return;
+    }
+    _writing = true;
+    boost::asio::async_write(_socket, boost::asio::buffer(_output.front()),
+			     std::bind(&ReplayConnection::onWrite, shared_from_this(), _1));
+  }
+
+  void onWrite(const boost::system::error_code& error) {
+    _writing = false;
+    if (_closed) {
+      return;
+    }
+    if (error) {
+      std::cerr << "Write error: " << error.message() << std::endl;
+      ++_stats.errors;
+      finish();
+      return;
+    }
+    ++_stats.delivered;
+    _output.pop_front();
+    if (! _output.empty()) {
+      startWrite();
+    }
+    else if (_closeRequested) {
+      shutdown();
+    }
+  }
+
+  void startRead() {
+    _socket.async_read_some(boost::asio::buffer(_input),
+			    std::bind(&ReplayConnection::onRead, shared_from_this(), _1, _2));
+  }
+
+  void onRead(const boost::system::error_code& error, size_t bytes) {
+    if (error) {
+      // The server hung up: after our shutdown(), or on its own (e.g. /shutdown).
+      finish();
+      return;
+    }
+    _stats.bytesReceived += bytes;
+    startRead();
+  }
+
+  void shutdown() {
+    boost::system::error_code ignored;
+    _socket.shutdown(StreamSocket::shutdown_send, ignored);
+  }
+
+  void finish() {
+    if (_closed) {
+      return;
+    }
+    _closed = true;
+    _output.clear();
+    boost::system::error_code ignored;
+    _socket.close(ignored);
+    _onClosed();
+  }
+
+  StreamSocket _socket;
+  ReplayStats& _stats;
+  std::function<void()> _onClosed;
+  std::deque<std::string> _output;
+  std::array<char, 4096> _input;
+  bool _connected;
+  bool _writing;
+  bool _closeRequested;
+  bool _closed;
+};
+
+// Walks the capture and fires every event at its recorded offset divided by 'speed'
+// (speed 0: as fast as the event loop goes). Events are read lazily, so captures of any size
+// replay in constant memory apart from the live connections.
+//
+// Sessions run side by side, so a /shutdown sent when the capture has it could reach the
+// server while other sessions still have lines in flight, and cut the replay short by however
+// much the timing left over. The first /shutdown is therefore held back, and its session
+// with it, until every other session has been read to the end by the server and closed.
+class Replayer {
+public:
+  Replayer(boost::asio::io_service& ioService, TrafficReader& reader,
+	   const StreamEndpoint& endpoint, double speed, ReplayStats& stats) :
+    _ioService(ioService),
+    _reader(reader),
+    _endpoint(endpoint),
+    _speed(speed),
+    _stats(stats),
+    _timer(ioService),
+    _open(0),
+    _exhausted(false) { }
+
+  void start() {
+    _start = Clock::now();
+    scheduleNext();
+  }
+
+private:
+  void scheduleNext() {
+    if (! _reader.next(_record)) {
+      for (auto& session : _sessions) {
+	session.second->close();
+      }
+      _sessions.clear();
+      _exhausted = true;
+      sendHeldShutdown();
+      return;
+    }
+    if (_speed <= 0.0) {
+      _ioService.post(std::bind(&Replayer::dispatch, this));
+      return;
+    }
+    _due = _start + std::chrono::duration_cast<Clock::duration>(
+      std::chrono::nanoseconds(static_cast<int64_t>(_record.timestamp / _speed)));
+    _timer.expires_at(_due);
+    _timer.async_wait(std::bind(&Replayer::onTimer, this, _1));
+  }
+
+  void onTimer(const boost::system::error_code& error) {
+    if (! error) {
+      _stats.maxLag = std::max(_stats.maxLag, Clock::now() - _due);
+      dispatch();
+    }
+  }
+
+  void dispatch() {
+    switch (_record.type) {
+    case CaptureEvent::CONNECT: {
+      auto connection = std::make_shared<ReplayConnection>(
+	_ioService, _stats, std::bind(&Replayer::onClosed, this));
+      connection->connect(_endpoint);
+      _sessions[_record.session] = connection;
+      ++_stats.sessions;
+      ++_open;
+      break;
+    }
+    case CaptureEvent::NAME:
+    case CaptureEvent::LINE: {
+      auto found = _sessions.find(_record.session);
+      if (found != _sessions.end()) {
+	++_stats.lines;
+	if (_record.payload == "/shutdown" && ! _held) {
+	  // Whatever this session does after /shutdown can't reach the server anyway.
+	  _held = found->second;
+	  _sessions.erase(found);
+	}
+	else {
+	  found->second->send(_record.payload);
+	}
+      }
+      break;
+    }
+    case CaptureEvent::DISCONNECT: {
+      auto found = _sessions.find(_record.session);
+      if (found != _sessions.end()) {
+	found->second->close();
+	_sessions.erase(found);
+      }
+      break;
+    }
+    }
+    scheduleNext();
+  }
+
+  void onClosed() {
+    --_open;
+    sendHeldShutdown();
+  }
+
+  void sendHeldShutdown() {
+    if (_exhausted && _held && _open == (_held->closed() ? 0 : 1)) {
+      _held->send("/shutdown");
+      _held->close();
+      _held.reset();
+    }
+  }
+
+  boost::asio::io_service& _ioService;
+  TrafficReader& _reader;
+  StreamEndpoint _endpoint;
+  double _speed;
+  ReplayStats& _stats;
+  boost::asio::steady_timer _timer;
+  Clock::time_point _start;
+  Clock::time_point _due;
+  CaptureRecord _record;
+  std::map<uint32_t, std::shared_ptr<ReplayConnection> > _sessions;
+  std::shared_ptr<ReplayConnection> _held;
+  size_t _open;  // connections not closed yet, the held one included
+  bool _exhausted;
+};
+
+// Writes a synthetic chat workload: 'sessions' users log in, exchange 'lines' lines with some
+// @mentions, /msg and /search commands mixed in, and leave, the first one with /shutdown if
+// asked to. Used as a training run for profile-guided builds when no real capture is at hand.
+static void generateCapture(const std::string& path, unsigned sessions, unsigned lines,
+			    unsigned lineBytes, bool shutdown) {
+  static const char* const words[] = {
+    "build", "deploy", "review", "merge", "request", "lunch", "coffee", "green", "failed",
+    "latency", "patch", "release", "tomorrow", "again", "works", "broken"
+  };
+  const unsigned wordCount = sizeof(words) / sizeof(words[0]);
+  TrafficRecorder recorder(path);
+  std::vector<uint32_t> ids;
+  for (unsigned s = 0; s < sessions; ++s) {
+    ids.push_back(recorder.newSession());
+    recorder.record(CaptureEvent::CONNECT, ids.back());
+    recorder.record(CaptureEvent::NAME, ids.back(), "user" + boost::lexical_cast<std::string>(s));
+  }
+  uint32_t seed = 12345;
+  auto random = [&seed](unsigned range) {
+    seed = seed * 1103515245 + 12345;
+    return (seed >> 16) % range;
+  };
+  for (unsigned n = 0; n < lines; ++n) {
+    std::string line;
+    unsigned kind = random(20);
+    if (kind == 0) {
+      line = "/search " + std::string(words[random(wordCount)]) + ' ' + words[random(wordCount)];
+    }
+    else if (kind == 1) {
+      line = "/msg user" + boost::lexical_cast<std::string>(random(sessions)) + ' ' + words[random(wordCount)];
+    }
+    else {
+      for (unsigned w = 0, count = 3 + random(8); w < count; ++w) {
+	line += words[random(wordCount)];
+	line += ' ';
+      }
+      if (kind == 2) {
+	line += "@user" + boost::lexical_cast<std::string>(random(sessions));
+      }
+      while (line.size() < lineBytes) {
+	line += ' ';
+	line += words[random(wordCount)];
+      }
+    }
+    recorder.record(CaptureEvent::LINE, ids[random(sessions)], line);
+  }
+  if (shutdown) {
+    recorder.record(CaptureEvent::LINE, ids.front(), "/shutdown");
+  }
+  for (uint32_t id : ids) {
+    recorder.record(CaptureEvent::DISCONNECT, id);
+  }
+  recorder.flush();
+}
+
+static void printUsage(std::ostream& stream, const char* program) {
+  stream << "Usage: " << program << " <capture> <host> <port> [options]\n"
+	 << "       " << program << " <capture> --unix <path> [options]\n"
+	 << "       " << program << " --generate <capture> [--sessions <n>] [--lines <n>]\n"
+	 << "           [--line-bytes <n>] [--shutdown]\n"
+	 << "  --speed <factor>   replay speed, 1 = original timing, 0 = as fast as possible\n";
+}
+
+int main(int argc, char **argv) {
+  std::vector<std::string> positional;
+  std::string unixPath;
+  std::string generatePath;
+  unsigned sessions = 50;
+  unsigned lines = 100000;
+  unsigned lineBytes = 0;
+  bool shutdown = false;
+  double speed = 1.0;
+  try {
+    for (int i = 1; i < argc; ++i) {
+      std::string arg = argv[i];
+      if (arg == "--speed" && i + 1 < argc) {
+	speed = boost::lexical_cast<double>(argv[++i]);
+      }
+      else if (arg == "--unix" && i + 1 < argc) {
+	unixPath = argv[++i];
+      }
+      else if (arg == "--generate" && i + 1 < argc) {
+	generatePath = argv[++i];
+      }
+      else if (arg == "--sessions" && i + 1 < argc) {
+	sessions = boost::lexical_cast<unsigned>(argv[++i]);
+      }
+      else if (arg == "--lines" && i + 1 < argc) {
+	lines = boost::lexical_cast<unsigned>(argv[++i]);
+      }
+      else if (arg == "--line-bytes" && i + 1 < argc) {
+	lineBytes = boost::lexical_cast<unsigned>(argv[++i]);
+      }
+      else if (arg == "--shutdown") {
+	shutdown = true;
+      }
+      else if (arg.compare(0, 2, "--") == 0) {
+	throw std::invalid_argument("unknown option " + arg);
+      }
+      else {
+	positional.push_back(arg);
+      }
+    }
+    if (! generatePath.empty() ? ! positional.empty() || sessions == 0
+	: positional.size() != (unixPath.empty() ? 3u : 1u)) {
+      throw std::invalid_argument("wrong number of arguments");
+    }
+  }
+  catch (std::exception &ex) {
+    std::cerr << ex.what() << std::endl;
+    printUsage(std::cerr, argv[0]);
+    return 1;
+  }
+
+  try {
+    if (! generatePath.empty()) {
+      generateCapture(generatePath, sessions, lines, lineBytes, shutdown);
+      return 0;
+    }
+    TrafficReader reader(positional[0]);
+    boost::asio::io_service ioService;
+    StreamEndpoint endpoint;
+    if (unixPath.empty()) {
+      tcp::resolver resolver(ioService);
+      endpoint = resolver.resolve(tcp::resolver::query(positional[1], positional[2]))->endpoint();
+    }
+    else {
+      endpoint = makeUnixEndpoint(unixPath);
+    }
+
+    ReplayStats stats;
+    Replayer replayer(ioService, reader, endpoint, speed, stats);
+    auto start = Clock::now();
+    replayer.start();
+    ioService.run();
+    double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    std::cout << "replayed " << stats.sessions << " sessions, " << stats.delivered << " of "
+	      << stats.lines << " lines in " << seconds << " s\n"
+	      << "  received    " << stats.bytesReceived << " bytes\n"
+	      << "  max lag     " << std::chrono::duration<double, std::micro>(stats.maxLag).count()
+	      << " us\n"
+	      << "  errors      " << stats.errors << '\n';
+    return stats.errors || stats.delivered != stats.lines ? 1 : 0;
+  }
+  catch (std::exception &ex) {
+    std::cerr << "Main thread exception: " << ex.what() << std::endl;
+    return 1;
+  }
+}
@@ -0,0 +1,181 @@
+#ifndef SERVER_OPTIONS_HPP
+#define SERVER_OPTIONS_HPP
+
+#include "low_latency.hpp"
+
+#include <boost/lexical_cast.hpp>
+
+#include <ostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Command line shared by the servers: <port> [options].
+struct ServerOptions {
+  int port = 0;
+  std::vector<int> cpus;
+  int busyPollUsec = 0;
+  bool spin = false;
+  int threads = 1;
+  bool numa = false;
+  int udpSockets = 0;
+  bool udpGro = false;
+  size_t fanOutThreshold = 1024;
+  size_t fanOutChunk = 256;
+  int fanOutWorkers = 0;
+  bool pollSessions = false;
+  int writerSpinUsec = 0;
+  size_t zeroCopyThreshold = 0;
+  size_t maxConnections = 0;
+  int presenceIntervalMs = 1000;
+  std::string unixPath;
+  std::string shmPath;
+  std::string recordPath;
+  std::string mailboxPath;
+  unsigned floodLimit = 0;
+  int floodWindowSec = 10;
+};
+
+inline void printServerUsage(std::ostream& stream, const char* program) {
+  stream << "Usage: " << program << " <port> [options]\n"
+	 << "  --cpus <list>        pin server threads to these CPUs (e.g. 2,3 or 4-7)\n"
+	 << "  --unix <path>        also listen on a Unix domain socket (@name: abstract namespace)\n"
+	 << "  --shm <path>         serve shared memory ring clients (shm_client), handing the\n"
+	 << "                       rings over on this Unix socket (threaded server only)\n"
+	 << "  --max-connections <n>\n"
+	 << "                       stop accepting while n clients are connected (default 0:\n"
+	 << "                       no limit)\n"
+	 << "  --record <file>      capture session traffic for the replay tool\n"
+	 << "  --mailbox <file>     keep /msg messages for offline users in this store\n"
+	 << "  --flood-limit <n>    drop a line repeated n times within the flood window (0: off)\n"
+	 << "  --flood-window <sec> flood window length (default 10)\n"
+	 << "  --presence-interval <ms>\n"
+	 << "                       batch join/leave notices over this interval (default 1000,\n"
+	 << "                       0 disables them)\n"
+	 << "  --busy-poll <usec>   set SO_BUSY_POLL on client sockets\n"
+	 << "  --spin               spin on the reactor instead of sleeping in epoll\n"
+	 << "                       (event-loop servers only, threaded rejects it)\n"
+	 << "  --threads <n>        run the io_service from n threads (echo_server only)\n"
+	 << "  --numa               run one reactor per NUMA node (echo_server only)\n"
+	 << "  --udp <sockets>      batched UDP echo on this many SO_REUSEPORT sockets\n"
+	 << "                       (echo_server only)\n"
+	 << "  --gro                with --udp, receive with UDP_GRO and echo with UDP_SEGMENT\n"
+	 << "  --fan-out-threshold <n>\n"
+	 << "                       split broadcasts to n or more clients into chunks\n"
+	 << "                       (default 1024, 0 disables)\n"
+	 << "  --fan-out-chunk <n>  recipients per chunk (default 256)\n"
+	 << "  --fan-out-workers <n>\n"
+	 << "                       fan-out threads, started once a room reaches the threshold\n"
+	 << "                       (threaded server only, default: one per core)\n"
+	 << "  --poll-sessions      serve each client from one thread polling its socket and an\n"
+	 << "                       eventfd, instead of a reader and a writer thread\n"
+	 << "                       (threaded server only)\n"
+	 << "  --writer-spin <usec> let writer threads spin up to this long for the next message\n"
+	 << "                       when messages have been arriving that fast (threaded server\n"
+	 << "                       only, default 0: always sleep)\n"
+	 << "  --zerocopy <bytes>   send messages of at least this size to TCP clients with\n"
+	 << "                       MSG_ZEROCOPY (threaded server without --poll-sessions only,\n"
+	 << "                       default 0: off)\n";
+}
+
+// Throws std::invalid_argument on malformed command line.
+inline ServerOptions parseServerOptions(int argc, char** argv) {
+  if (argc < 2) {
+    throw std::invalid_argument("missing port");
+  }
+  ServerOptions options;
+  options.port = boost::lexical_cast<int>(argv[1]);
+  for (int i = 2; i < argc; ++i) {
+    std::string arg = argv[i];
+    auto value = [&]() -> std::string {
+      if (i + 1 >= argc) {
+	throw std::invalid_argument("missing value for " + arg);
+      }
+      return argv[++i];
+    };
+    if (arg == "--cpus") {
+      options.cpus = parseCpuList(value());
+    }
+    else if (arg == "--unix") {
+      options.unixPath = value();
+    }
+    else if (arg == "--shm") {
+      options.shmPath = value();
+    }
+    else if (arg == "--max-connections") {
+      options.maxConnections = boost::lexical_cast<size_t>(value());
+    }
+    else if (arg == "--record") {
+      options.recordPath = value();
+    }
+    else if (arg == "--mailbox") {
+      options.mailboxPath = value();
+    }
+    else if (arg == "--flood-limit") {
+      options.floodLimit = boost::lexical_cast<unsigned>(value());
+      if (options.floodLimit > 65535) {
+	throw std::invalid_argument("--flood-limit must be at most 65535");
+      }
+    }
+    else if (arg == "--flood-window") {
+      options.floodWindowSec = boost::lexical_cast<int>(value());
+      if (options.floodWindowSec < 1) {
+	throw std::invalid_argument("--flood-window must be positive");
+      }
+    }
+    else if (arg == "--presence-interval") {
+      options.presenceIntervalMs = boost::lexical_cast<int>(value());
+    }
+    else if (arg == "--busy-poll") {
+      options.busyPollUsec = boost::lexical_cast<int>(value());
+    }
+    else if (arg == "--spin") {
+      options.spin = true;
+    }
+    else if (arg == "--threads") {
+      options.threads = boost::lexical_cast<int>(value());
+      if (options.threads < 1) {
+	throw std::invalid_argument("--threads needs at least one thread");
+      }
+    }
+    else if (arg == "--numa") {
+      options.numa = true;
+    }
+    else if (arg == "--udp") {
+      options.udpSockets = boost::lexical_cast<int>(value());
+    }
+    else if (arg == "--gro") {
+      options.udpGro = true;
+    }
+    else if (arg == "--fan-out-threshold") {
+      options.fanOutThreshold = boost::lexical_cast<size_t>(value());
+    }
+    else if (arg == "--fan-out-chunk") {
+      options.fanOutChunk = boost::lexical_cast<size_t>(value());
+      if (options.fanOutChunk == 0) {
+	throw std::invalid_argument("--fan-out-chunk must be positive");
+      }
+    }
+    else if (arg == "--fan-out-workers") {
+      options.fanOutWorkers = boost::lexical_cast<int>(value());
+    }
+    else if (arg == "--poll-sessions") {
+      options.pollSessions = true;
+    }
+    else if (arg == "--zerocopy") {
+      options.zeroCopyThreshold = boost::lexical_cast<size_t>(value());
+    }
+    else if (arg == "--writer-spin") {
+      options.writerSpinUsec = boost::lexical_cast<int>(value());
+      if (options.writerSpinUsec < 0) {
+	throw std::invalid_argument("--writer-spin must not be negative");
+      }
+    }
+    else {
+      throw std::invalid_argument("unknown option " + arg);
+    }
+  }
+  return options;
+}
+
+#endif
@@ -0,0 +1,154 @@
+#include <boost/asio.hpp>
+#include <boost/lexical_cast.hpp>
+
+#include "latency_histogram.hpp"
+#include "shm_ring.hpp"
+#include "tsc_clock.hpp"
+#include "unix_listener.hpp"
+
+#include <poll.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+
+typedef TscSteadyClock Clock;
+
+static void printUsage(std::ostream& stream, const char* program) {
+  stream << "Usage: " << program << " <path> [options]\n"
+	 << "  Connects to the threaded server's --shm listener (@name: abstract namespace) and\n"
+	 << "  bridges stdin and stdout to the chat until the server closes it; send /quit to leave.\n"
+	 << "  --ping <n>      log in, time n /search round trips and print their latency\n"
+	 << "  --name <name>   login name for --ping (default bot<pid>)\n"
+	 << "  --socket        with --ping, talk over the server's --unix socket at <path> instead,\n"
+	 << "                  for comparison\n";
+}
+
+template <class Stream>
+static std::string readLine(Stream& stream, boost::asio::streambuf& buffer) {
+  boost::asio::read_until(stream, buffer, '\n');
+  std::istream input(&buffer);
+  std::string line;
+  std::getline(input, line);
+  return line;
+}
+
+// A /search nobody's lines match makes a one-line round trip through the server.
+template <class Stream>
+static void ping(Stream& stream, const std::string& name, unsigned count) {
+  static const std::string query = "/search shmpingprobe\n";
+  static const std::string reply = "*** 0 matches for shmpingprobe";
+  boost::asio::streambuf buffer;
+  readLine(stream, buffer);
+  boost::asio::write(stream, boost::asio::buffer(name + '\n'));
+  std::string welcome = readLine(stream, buffer);
+  if (welcome.compare(0, 7, "Welcome") != 0) {
+    throw std::runtime_error(welcome);
+  }
+
+  LatencyHistogram latency;
+  for (unsigned i = 0; i < count; ++i) {
+    auto start = Clock::now();
+    boost::asio::write(stream, boost::asio::buffer(query));
+    while (readLine(stream, buffer) != reply);
+    latency.record(std::chrono::duration_cast<std::chrono::nanoseconds>(Clock::now() - start).count());
+  }
+  boost::asio::write(stream, boost::asio::buffer(std::string("/quit\n")));
+  std::cout << "round trips:\n";
+  latency.print(std::cout, "us", 1000.0);
+}
+
+static void bridge(ShmRingStream& ring) {
+  // stdin is polled with a timeout, so the thread notices when the server has gone.
+  std::atomic<bool> done(false);
+  std::thread input([&ring, &done]() {
+    char buffer[4096];
+    try {
+      while (! done) {
+	pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+	if (poll(&pfd, 1, ShmRingStream::LIVENESS_CHECK_MS) <= 0) {
+	  continue;
+	}
+	ssize_t size = read(STDIN_FILENO, buffer, sizeof(buffer));
+	if (size <= 0) {
+	  break;
+	}
+	boost::asio::write(ring, boost::asio::buffer(buffer, size));
+      }
+    }
+    catch (std::exception&) { }
+  });
+
+  char buffer[65536];
+  boost::system::error_code ec;
+  while (true) {
+    size_t size = ring.read_some(boost::asio::buffer(buffer), ec);
+    if (ec) {
+      break;
+    }
+    std::cout.write(buffer, size).flush();
+  }
+  done = true;
+  input.join();
+}
+
+int main(int argc, char **argv) {
+  std::string path;
+  std::string name = "bot" + boost::lexical_cast<std::string>(getpid());
+  unsigned pings = 0;
+  bool overSocket = false;
+  try {
+    for (int i = 1; i < argc; ++i) {
+      std::string arg = argv[i];
+      if (arg == "--ping" && i + 1 < argc) {
+	pings = boost::lexical_cast<unsigned>(argv[++i]);
+      }
+      else if (arg == "--name" && i + 1 < argc) {
+	name = argv[++i];
+      }
+      else if (arg == "--socket") {
+	overSocket = true;
+      }
+      else if (arg.compare(0, 2, "--") == 0 || ! path.empty()) {
+	throw std::invalid_argument("unexpected argument " + arg);
+      }
+      else {
+	path = arg;
+      }
+    }
+    if (path.empty()) {
+      throw std::invalid_argument("missing path");
+    }
+  }
+  catch (std::exception &ex) {
+    std::cerr << ex.what() << std::endl;
+    printUsage(std::cerr, argv[0]);
+    return 1;
+  }
+
+  try {
+    if (overSocket) {
+      boost::asio::io_service ioService;
+      boost::asio::local::stream_protocol::socket socket(ioService);
+      socket.connect(makeUnixEndpoint(path));
+      ping(socket, name, pings);
+    }
+    else {
+      auto ring = ShmRingStream::connect(path);
+      if (pings) {
+	ping(*ring, name, pings);
+      }
+      else {
+	bridge(*ring);
+      }
+    }
+  }
+  catch (std::exception &ex) {
+    std::cerr << "Main thread exception: " << ex.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
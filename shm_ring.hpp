@@ -0,0 +1,373 @@
+#ifndef SHM_RING_HPP
+#define SHM_RING_HPP
+
+#include "unix_listener.hpp"
+
+#include <boost/asio.hpp>
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+// Byte stream between two processes on one host through a pair of single-producer,
+// single-consumer rings in a memfd mapping, one ring per direction. Moving a line is a
+// memcpy and a couple of atomic operations; a syscall is only needed to wake a peer that
+// went to sleep waiting, on a futex in the mapping.
+//
+// The mapping is handed over on a Unix socket: the server creates it and passes the memfd
+// with SCM_RIGHTS. The socket stays open as the liveness channel: a peer that exits without
+// closing the stream is noticed by the socket hanging up, checked whenever a wait times out.
+//
+// ShmRingStream has the read_some()/write_some() interface of Boost.Asio's synchronous
+// streams, so boost::asio::read_until() and boost::asio::write() work on it as on a socket.
+// One thread reads; writes are serialized, so several threads may write.
+class ShmRingStream {
+public:
+  enum {
+    RING_BYTES = 256 * 1024,  // per direction, a power of two
+    LIVENESS_CHECK_MS = 100
+  };
+
+  // Server side of the handshake, on a freshly accepted Unix socket it doesn't take over.
+  static std::unique_ptr<ShmRingStream> serve(int controlFd) {
+    int memfd = memfd_create("chat-ring", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (memfd < 0) {
+      throw std::system_error(errno, std::system_category(), "memfd_create");
+    }
+    std::unique_ptr<ShmRingStream> stream;
+    try {
+      if (ftruncate(memfd, MAPPING_BYTES) < 0) {
+	throw std::system_error(errno, std::system_category(), "ftruncate");
+      }
+      // The client can't shrink the file under us (which would SIGBUS the server).
+      if (fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) < 0) {
+	throw std::system_error(errno, std::system_category(), "F_ADD_SEALS");
+      }
+      stream.reset(new ShmRingStream(controlFd, false, map(memfd), true));
+      Layout* layout = stream->_layout;
+      layout->magic = MAGIC;
+      layout->ringBytes = RING_BYTES;
+      sendFd(controlFd, memfd);
+    }
+    catch (...) {
+      ::close(memfd);
+      throw;
+    }
+    ::close(memfd);
+    return stream;
+  }
+
+  // Client side: connects to the server's ring listener ("@name" for the abstract
+  // namespace) and maps the rings it sends.
+  static std::unique_ptr<ShmRingStream> connect(const std::string& path) {
+    int controlFd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (controlFd < 0) {
+      throw std::system_error(errno, std::system_category(), "socket");
+    }
+    int memfd = -1;
+    try {
+      auto endpoint = makeUnixEndpoint(path);
+      if (::connect(controlFd, endpoint.data(), endpoint.size()) < 0) {
+	throw std::system_error(errno, std::system_category(), "connect " + path);
+      }
+      memfd = receiveFd(controlFd);
+      struct stat status;
+      if (fstat(memfd, &status) < 0 || status.st_size != MAPPING_BYTES) {
+	throw std::runtime_error("shared memory ring has an unexpected size");
+      }
+      std::unique_ptr<ShmRingStream> stream(new ShmRingStream(controlFd, true, map(memfd), false));
+      ::close(memfd);
+      if (stream->_layout->magic != MAGIC || stream->_layout->ringBytes != RING_BYTES) {
+	throw std::runtime_error("shared memory ring has an unknown layout");
+      }
+      return stream;
+    }
+    catch (...) {
+      if (memfd >= 0) {
+	::close(memfd);
+      }
+      ::close(controlFd);
+      throw;
+    }
+  }
+
+  ~ShmRingStream() {
+    close();
+    munmap(_layout, MAPPING_BYTES);
+    if (_ownsControlFd) {
+      ::close(_controlFd);
+    }
+  }
+
+  ShmRingStream(const ShmRingStream&) = delete;
+  ShmRingStream& operator=(const ShmRingStream&) = delete;
+
+  // Ends the stream both ways and wakes whoever waits on either side. Bytes already in a
+  // ring are still delivered, then reads see end of file.
+  void close() {
+    _layout->closed.store(1);
+    for (Ring& ring : _layout->rings) {
+      wake(ring.dataSequence);
+      wake(ring.spaceSequence);
+    }
+  }
+
+  template <class MutableBuffers>
+  size_t read_some(const MutableBuffers& buffers, boost::system::error_code& ec) {
+    Ring& ring = _layout->rings[_inRing];
+    uint64_t tail = _readPosition;
+    if (! waitUntil(ring.dataSequence, ring.consumerWaiting,
+		    [&ring, tail]() { return ring.head.load() != tail; })) {
+      ec = boost::asio::error::eof;
+      return 0;
+    }
+    uint64_t available = ring.head.load(std::memory_order_acquire) - tail;
+    if (available > RING_BYTES) {
+      return protocolError(ec);
+    }
+    size_t copied = 0;
+    for (auto it = boost::asio::buffer_sequence_begin(buffers);
+	 it != boost::asio::buffer_sequence_end(buffers) && copied < available; ++it) {
+      boost::asio::mutable_buffer buffer(*it);
+      size_t size = std::min<uint64_t>(buffer.size(), available - copied);
+      copyOut(data(_inRing), tail + copied, static_cast<char*>(buffer.data()), size);
+      copied += size;
+    }
+    _readPosition = tail + copied;
+    ring.tail.store(_readPosition);
+    if (ring.producerWaiting.load()) {
+      wake(ring.spaceSequence);
+    }
+    ec = boost::system::error_code();
+    return copied;
+  }
+
+  template <class ConstBuffers>
+  size_t write_some(const ConstBuffers& buffers, boost::system::error_code& ec) {
+    std::lock_guard<std::mutex> guard(_writeMutex);
+    Ring& ring = _layout->rings[1 - _inRing];
+    uint64_t head = _writePosition;
+    if (! waitUntil(ring.spaceSequence, ring.producerWaiting,
+		    [&ring, head]() { return head - ring.tail.load() != RING_BYTES; })) {
+      ec = boost::asio::error::broken_pipe;
+      return 0;
+    }
+    uint64_t used = head - ring.tail.load(std::memory_order_acquire);
+    if (used > RING_BYTES) {
+      return protocolError(ec);
+    }
+    uint64_t space = RING_BYTES - used;
+    size_t copied = 0;
+    for (auto it = boost::asio::buffer_sequence_begin(buffers);
+	 it != boost::asio::buffer_sequence_end(buffers) && copied < space; ++it) {
+      boost::asio::const_buffer buffer(*it);
+      size_t size = std::min<uint64_t>(buffer.size(), space - copied);
+      copyIn(data(1 - _inRing), head + copied, static_cast<const char*>(buffer.data()), size);
+      copied += size;
+    }
+    _writePosition = head + copied;
+    ring.head.store(_writePosition);
+    if (ring.consumerWaiting.load()) {
+      wake(ring.dataSequence);
+    }
+    ec = boost::system::error_code();
+    return copied;
+  }
+
+  template <class MutableBuffers>
+  size_t read_some(const MutableBuffers& buffers) {
+    boost::system::error_code ec;
+    size_t size = read_some(buffers, ec);
+    if (ec) {
+      throw boost::system::system_error(ec, "read_some");
+    }
+    return size;
+  }
+
+  template <class ConstBuffers>
+  size_t write_some(const ConstBuffers& buffers) {
+    boost::system::error_code ec;
+    size_t size = write_some(buffers, ec);
+    if (ec) {
+      throw boost::system::system_error(ec, "write_some");
+    }
+    return size;
+  }
+
+private:
+  enum : uint32_t {
+    MAGIC = 0x52494e47  // "RING"
+  };
+
+  // Positions count bytes since the start and never wrap; the producer owns head, the
+  // consumer tail. Each side keeps its own position in private memory and reads the peer's
+  // once per call, checking it, as the peer may write anything to the mapping. A side about
+  // to sleep raises its waiting flag, then re-checks the ring; the other side publishes its
+  // position, then checks the flag. Both sequentially consistent, so at least one of them
+  // sees the other and no wakeup is lost.
+  struct Ring {
+    alignas(64) std::atomic<uint64_t> head;
+    std::atomic<uint32_t> dataSequence;  // futex the consumer sleeps on
+    std::atomic<uint32_t> consumerWaiting;
+    alignas(64) std::atomic<uint64_t> tail;
+    std::atomic<uint32_t> spaceSequence;  // futex the producer sleeps on
+    std::atomic<uint32_t> producerWaiting;
+  };
+
+  // rings[0] carries client to server, rings[1] server to client.
+  struct Layout {
+    uint32_t magic;
+    uint32_t ringBytes;
+    std::atomic<uint32_t> closed;
+    Ring rings[2];
+  };
+
+  enum : size_t {
+    HEADER_BYTES = (sizeof(Layout) + 4095) / 4096 * 4096,
+    MAPPING_BYTES = HEADER_BYTES + 2 * RING_BYTES
+  };
+
+  ShmRingStream(int controlFd, bool ownsControlFd, void* mapping, bool server) :
+    _controlFd(controlFd),
+    _ownsControlFd(ownsControlFd),
+    _layout(static_cast<Layout*>(mapping)),
+    _inRing(server ? 0 : 1),
+    _readPosition(0),
+    _writePosition(0) { }
+
+  static void* map(int memfd) {
+    void* mapping = mmap(nullptr, MAPPING_BYTES, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (mapping == MAP_FAILED) {
+      throw std::system_error(errno, std::system_category(), "mmap");
+    }
+    return mapping;
+  }
+
+  char* data(int ring) {
+    return reinterpret_cast<char*>(_layout) + HEADER_BYTES + ring * RING_BYTES;
+  }
+
+  // A peer position more than RING_BYTES away from ours: the stream can't be trusted any more.
+  size_t protocolError(boost::system::error_code& ec) {
+    close();
+    ec = boost::system::errc::make_error_code(boost::system::errc::protocol_error);
+    return 0;
+  }
+
+  static void copyOut(const char* ring, uint64_t position, char* out, size_t size) {
+    size = std::min<size_t>(size, RING_BYTES);
+    size_t offset = position & (RING_BYTES - 1);
+    size_t first = std::min<size_t>(size, RING_BYTES - offset);
+    memcpy(out, ring + offset, first);
+    memcpy(out + first, ring, size - first);
+  }
+
+  static void copyIn(char* ring, uint64_t position, const char* in, size_t size) {
+    size = std::min<size_t>(size, RING_BYTES);
+    size_t offset = position & (RING_BYTES - 1);
+    size_t first = std::min<size_t>(size, RING_BYTES - offset);
+    memcpy(ring + offset, in, first);
+    memcpy(ring, in + first, size - first);
+  }
+
+  // Waits until ready(), sleeping on 'sequence' with 'waiting' raised. False once the stream
+  // is closed, by either side or by the peer's socket hanging up.
+  template <class Ready>
+  bool waitUntil(std::atomic<uint32_t>& sequence, std::atomic<uint32_t>& waiting, Ready ready) {
+    while (! ready()) {
+      if (_layout->closed.load()) {
+	return false;
+      }
+      uint32_t expected = sequence.load();
+      waiting.store(1);
+      if (! ready() && ! _layout->closed.load()) {
+	timespec timeout = { 0, LIVENESS_CHECK_MS * 1000000L };
+	syscall(SYS_futex, reinterpret_cast<uint32_t*>(&sequence), FUTEX_WAIT, expected, &timeout,
+		nullptr, 0);
+      }
+      waiting.store(0);
+      if (! ready() && peerGone()) {
+	close();
+      }
+    }
+    return true;
+  }
+
+  static void wake(std::atomic<uint32_t>& sequence) {
+    sequence.fetch_add(1);
+    syscall(SYS_futex, reinterpret_cast<uint32_t*>(&sequence), FUTEX_WAKE, INT_MAX, nullptr,
+	    nullptr, 0);
+  }
+
+  bool peerGone() {
+    pollfd pfd = { _controlFd, POLLRDHUP, 0 };
+    return poll(&pfd, 1, 0) > 0 && (pfd.revents & (POLLRDHUP | POLLHUP | POLLERR));
+  }
+
+  static void sendFd(int socket, int fd) {
+    char byte = 'R';
+    iovec iov = { &byte, 1 };
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+    if (sendmsg(socket, &msg, MSG_NOSIGNAL) < 0) {
+      throw std::system_error(errno, std::system_category(), "sendmsg(SCM_RIGHTS)");
+    }
+  }
+
+  static int receiveFd(int socket) {
+    char byte;
+    iovec iov = { &byte, 1 };
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+    msghdr msg = {};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+    ssize_t received;
+    while ((received = recvmsg(socket, &msg, MSG_CMSG_CLOEXEC)) < 0 && errno == EINTR);
+    if (received < 0) {
+      throw std::system_error(errno, std::system_category(), "recvmsg(SCM_RIGHTS)");
+    }
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (received != 1 || byte != 'R' || ! cmsg || cmsg->cmsg_type != SCM_RIGHTS) {
+      throw std::runtime_error("server didn't send a shared memory ring");
+    }
+    int fd;
+    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+    return fd;
+  }
+
+  const int _controlFd;
+  const bool _ownsControlFd;
+  Layout* _layout;
+  const int _inRing;
+  uint64_t _readPosition;  // the reading thread's
+  std::mutex _writeMutex;
+  uint64_t _writePosition;  // under _writeMutex
+};
+
+#endif
@@ -5,9 +5,168 @@
 #include <string>
 #include <algorithm>
 #include <bitset>
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <thread>
+
+// A board's points for each of its letters as the center, by place as in the printing loop:
+// the board's lowest set bit is place 6.
+typedef std::array<int, 7> Scores;
+
+// Every board against every word: cost grows with boards times words.
+static void scanScores(const std::vector<unsigned>& boards, const std::vector<unsigned>& words,
+		       std::vector<Scores>& scores) {
+  for (size_t board = 0; board < boards.size(); ++board) {
+    unsigned const seven = boards[board];
+    Scores& score = scores[board];
+    score.fill(0);
+    for (unsigned word : words) {
+      if (!(word & ~seven)) {
+	unsigned rest = seven;
+	for (int place = 7; --place >= 0; rest &= rest - 1) {
+	  if (word & rest & -rest) {
+	    ++score[place];
+	  }
+	}
+      }
+    }
+  }
+}
+
+// Runs f(begin, end) over [0, n) split across threads.
+template <class F>
+static void parallelFor(size_t n, unsigned threads, F f) {
+  threads = std::max(1u, std::min<unsigned>(threads, n));
+  std::vector<std::thread> workers;
+  for (unsigned t = 1; t < threads; ++t) {
+    workers.emplace_back(f, n * t / threads, n * (t + 1) / threads);
+  }
+  f(0, n / threads);
+  for (auto& worker : workers) {
+    worker.join();
+  }
+}
+
+// Turns table[mask] into the sum of table[] over all subsets of mask, one letter bit at a
+// time. The low LOW_BITS are done block by block, each block in cache; the high bits GROUP_BITS
+// at a time over tiles of 2^GROUP_BITS rows of ROW entries. The 256 MB table is streamed
+// through five times, the low pass plus four high-bit passes, instead of once for the low bits
+// and once per high bit, 14 times. Blocks and tiles go to the threads.
+static void subsetSums(std::vector<uint32_t>& table, unsigned threads) {
+  enum { LETTERS = 26, LOW_BITS = 13, GROUP_BITS = 4, ROW_BITS = 10, ROW = 1 << ROW_BITS };
+  uint32_t* const data = table.data();
+  parallelFor(size_t(1) << (LETTERS - LOW_BITS), threads, [data](size_t begin, size_t end) {
+      for (size_t block = begin; block < end; ++block) {
+	uint32_t* const base = data + (block << LOW_BITS);
+	for (unsigned bit = 0; bit < LOW_BITS; ++bit) {
+	  for (size_t mask = 0; mask < (size_t(1) << LOW_BITS); ++mask) {
+	    if (mask & (size_t(1) << bit)) {
+	      base[mask] += base[mask ^ (size_t(1) << bit)];
+	    }
+	  }
+	}
+      }
+    });
+  for (unsigned low = LOW_BITS; low < LETTERS; low += GROUP_BITS) {
+    unsigned const group = std::min<unsigned>(GROUP_BITS, LETTERS - low);
+    size_t const rowsBelow = size_t(1) << (low - ROW_BITS);
+    size_t const tiles = size_t(1) << (LETTERS - group - ROW_BITS);
+    parallelFor(tiles, threads, [=](size_t begin, size_t end) {
+	for (size_t tile = begin; tile < end; ++tile) {
+	  uint32_t* const base = data + (tile % rowsBelow) * ROW + ((tile / rowsBelow) << (low + group));
+	  for (unsigned bit = 0; bit < group; ++bit) {
+	    for (size_t sub = 0; sub < (size_t(1) << group); ++sub) {
+	      if (sub & (size_t(1) << bit)) {
+		uint32_t* const to = base + (sub << low);
+		uint32_t const* const from = base + ((sub ^ (size_t(1) << bit)) << low);
+		for (size_t i = 0; i < ROW; ++i) {
+		  to[i] += from[i];
+		}
+	      }
+	    }
+	  }
+	}
+      });
+  }
+}
+
+// Counts words by letter set into a 2^26 table and sums it over subsets once; a board's
+// score for a center is then the words within the board less those within the board without
+// the center, two lookups. Costs the same for any dictionary, so pays off once the scan's
+// boards times words outgrows it.
+static void zetaScores(const std::vector<unsigned>& boards, const std::vector<unsigned>& words,
+		       std::vector<Scores>& scores, unsigned threads) {
+  std::vector<uint32_t> table(size_t(1) << 26);
+  for (unsigned word : words) {
+    ++table[word];
+  }
+  subsetSums(table, threads);
+  for (size_t board = 0; board < boards.size(); ++board) {
+    unsigned const seven = boards[board];
+    unsigned rest = seven;
+    for (int place = 7; --place >= 0; rest &= rest - 1) {
+      scores[board][place] = table[seven] - table[seven & ~(rest & -rest)];
+    }
+  }
+}
+
+// Times both engines on every 2^k-th word and board, k decreasing: the dictionaries grow
+// toward the full one and the crossover shows where zeta's time drops below the scan's.
+static void bench(const std::vector<unsigned>& boards, const std::vector<unsigned>& words,
+		  unsigned threads) {
+  typedef std::chrono::steady_clock Clock;
+  auto millis = [](Clock::duration d) {
+    return std::chrono::duration<double, std::milli>(d).count();
+  };
+  std::cout << "words\tboards\tscan ms\tzeta ms\n";
+  for (int shift = 6; shift >= 0; --shift) {
+    std::vector<unsigned> someBoards, someWords;
+    for (size_t i = 0; i < boards.size(); i += size_t(1) << shift) {
+      someBoards.push_back(boards[i]);
+    }
+    for (size_t i = 0; i < words.size(); i += size_t(1) << shift) {
+      someWords.push_back(words[i]);
+    }
+    std::vector<Scores> scanned(someBoards.size()), zeta(someBoards.size());
+    auto start = Clock::now();
+    scanScores(someBoards, someWords, scanned);
+    auto middle = Clock::now();
+    zetaScores(someBoards, someWords, zeta, threads);
+    auto end = Clock::now();
+    if (scanned != zeta) {
+      std::cerr << "engines disagree\n";
+      std::exit(1);
+    }
+    std::cout << someWords.size() << '\t' << someBoards.size() << '\t'
+	      << millis(middle - start) << '\t' << millis(end - middle) << '\n';
+  }
+}
 
 int main(int argc, char** argv) {
-  std::string name = (argc > 1) ? argv[1] : "/usr/share/dict/words";
+  std::string name = "/usr/share/dict/words";
+  bool zeta = false, benchmark = false;
+  unsigned threads = std::max(1u, std::thread::hardware_concurrency());
+  for (int i = 1; i < argc; ++i) {
+    std::string arg = argv[i];
+    if (arg == "--zeta") {
+      zeta = true;
+    }
+    else if (arg == "--bench") {
+      benchmark = true;
+    }
+    else if (arg == "--threads" && i + 1 < argc) {
+      threads = std::max(1, std::atoi(argv[++i]));
+    }
+    else if (arg.compare(0, 2, "--") == 0) {
+      return std::cerr << "usage: " << argv[0]
+		       << " [--zeta] [--bench] [--threads n] [word list, - for stdin]\n", 1;
+    }
+    else {
+      name = arg;
+    }
+  }
   std::ifstream fs;
   std::istream& file = name == "-" ? std::cin : (fs.open(name), fs);
   if (!file) {
@@ -29,3 +188,46 @@ int main(int argc, char** argv) {
     else {
       ones = 8;
     }
+  }
+
+  // Each distinct seven-letter set is a candidate board; every word using all seven letters
+  // (a pangram) is worth 3 points.
+  std::sort(sevens.begin(), sevens.end());
+  std::vector<unsigned> counts(sevens.size());
+  int count = -1; unsigned prev = 0;
+  for (unsigned seven : sevens) {
+    if (prev != seven) {
+      sevens[++count] = prev = seven;
+    }
+    counts[count] += 3;
+  }
+  sevens.resize(count + 1);
+  if (benchmark) {
+    return bench(sevens, words, threads), 0;
+  }
+
+  // Score every letter of the board as the required center letter: one point per shorter
+  // word drawn from the board that contains it. Boards with a center scoring 26..32 are
+  // printed, letters in alphabetical order, good centers in upper case.
+  std::vector<Scores> scores(sevens.size());
+  if (zeta) {
+    zetaScores(sevens, words, scores, threads);
+  }
+  else {
+    scanScores(sevens, words, scores);
+  }
+  for (; count >= 0; --count) {
+    unsigned const seven = sevens[count];
+    bool any = false; unsigned rest = seven;
+    char out[8]; out[7] = '\0';
+    for (int place = 7; --place >= 0; rest &= rest - 1) {
+      int points = scores[count][place] + counts[count];
+      char a = (points >= 26 && points <= 32) ? any = true, 'A' : 'a';
+      out[place] = a + (25 - __builtin_ctz(rest));
+    }
+    if (any) {
+      std::cout << out << '\n';
+    }
+  }
+  return 0;
+}
@@ -1,13 +1,38 @@
 #include <boost/asio.hpp>
-#include <boost/date_time.hpp>
 #include <boost/lexical_cast.hpp>
 
+#include "accept_controller.hpp"
+#include "adaptive_wait.hpp"
+#include "alloc_profiler.hpp"
+#include "chat_index.hpp"
+#include "flood_filter.hpp"
+#include "latency_histogram.hpp"
+#include "mailbox_store.hpp"
+#include "mention_matcher.hpp"
+#include "presence_batcher.hpp"
+#include "server_options.hpp"
+#include "shm_ring.hpp"
+#include "traffic_capture.hpp"
+#include "tsc_clock.hpp"
+#include "unix_listener.hpp"
+#include "zero_copy_sender.hpp"
+
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
 #include <thread>
 #include <mutex>
 #include <condition_variable>
 #include <atomic>
 
+#include <algorithm>
+#include <cstring>
 #include <deque>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
 #include <map>
 #include <set>
 
@@ -17,9 +42,10 @@ class ChatServer;
 
 class ClientSession : public std::enable_shared_from_this<ClientSession> {
 public:
-  ClientSession(ChatServer& server, boost::asio::io_service &ioService);
+  ClientSession(ChatServer& server, boost::asio::io_service &ioService, const ServerOptions& options);
+  ~ClientSession();
 
-  boost::asio::ip::tcp::socket& socket() {
+  StreamSocket& socket() {
     return _socket;
   }
 
@@ -33,15 +59,25 @@ public:
     _nameValid = true;
   }
 
-  void start();
+  void attachRing();
+  // cpu < 0: don't pin.
+  void start(int cpu = -1);
   void sendMessage(const std::shared_ptr<std::string>& msg);
   void terminate();
   void waitToFinish();
 
 private:
   void readerThread();
+  void pinToCpu();
+  bool readLine(std::string& line);
   std::string readLineFromClient();
+  template <class Buffers>
+  void writeToClient(const Buffers& buffers);
+  bool pollLine(std::string& line);
+  bool writeQueuedMessages();
+  void wakePoller();
   bool parseLine(const std::string& line);
+  void record(CaptureEvent event, const std::string& payload = std::string());
   void writerThread();
   std::shared_ptr<std::string> getMessage();
   void interruptReader();
@@ -56,17 +92,33 @@ private:
     READER_TERMINATION_REQUESTED = 4
   };
 
+  enum {
+    POLL_READ_SIZE = 4096
+  };
+
   ChatServer& _server;
-  boost::asio::ip::tcp::socket _socket;
+  StreamSocket _socket;
+  // Set for shared memory clients, whose _socket then only serves the handshake and
+  // tells when they hang up.
+  std::unique_ptr<ShmRingStream> _ring;
   std::string _name;
   bool _nameValid;
   boost::asio::streambuf _inputBuffer;
   std::mutex _messagesMutex;
   std::deque<std::shared_ptr<std::string> > _messages;
-  std::condition_variable _writerCondition;
+  AdaptiveWait _writerWait;
+  // Polling sessions only: signalled when _messages gets its first entry or on terminate().
+  int _eventFd;
+  std::deque<std::shared_ptr<std::string> > _sending;
+  std::vector<boost::asio::const_buffer> _sendBuffers;
+  bool _outputFailed;
+  size_t _zeroCopyThreshold;
   std::thread _readerThread;
+  std::mutex _readerJoinMutex;
   std::thread _writerThread;
+  int _cpu;
   std::atomic<int> _state;
+  uint32_t _captureId;
 };
 
 template <class T>
@@ -84,85 +136,313 @@ struct PtrLess {
   }
 };
 
+// Broadcasting to big rooms on a pool of threads. Every logged-in client belongs to one
+// worker's shard (picked by name) for its whole life, and each worker delivers its shard's
+// part of every broadcast in FIFO order. So recipients see messages in broadcast order, while
+// the sender's reader thread only queues one job per worker instead of walking the whole room.
+// The threads start with the first job, when a room first gets big enough to need them.
+class FanOutWorkers {
+public:
+  FanOutWorkers(int workers);
+  ~FanOutWorkers();
+
+  void addClient(const std::shared_ptr<ClientSession>& client);
+  void removeClient(const std::shared_ptr<ClientSession>& client);
+  void broadcast(ClientSession& sender, const std::shared_ptr<std::string>& msg);
+  void broadcastToAll(const std::shared_ptr<std::string>& msg);
+  void sendTo(const std::shared_ptr<ClientSession>& receiver, const std::shared_ptr<std::string>& msg);
+
+  // True while some broadcast is still being delivered. Senders must then queue behind it
+  // rather than deliver inline, or their recipients could see messages reordered.
+  bool busy() const {
+    return _pending != 0;
+  }
+
+private:
+  struct Job {
+    std::shared_ptr<ClientSession> sender;
+    std::shared_ptr<std::string> msg;
+    std::shared_ptr<ClientSession> target;  // set for sendTo() jobs
+  };
+
+  struct Worker {
+    std::mutex clientsMutex;
+    std::vector<std::shared_ptr<ClientSession> > clients;
+    std::mutex jobsMutex;
+    std::deque<Job> jobs;
+    std::condition_variable jobsCondition;
+    bool stopping = false;
+    std::thread thread;
+  };
+
+  Worker& workerFor(const std::shared_ptr<ClientSession>& client);
+  void start();
+  void pushToAll(const Job& job);
+  void workerThread(Worker& worker);
+  bool getJob(Worker& worker, Job& job);
+
+  std::vector<std::unique_ptr<Worker> > _workers;
+  std::once_flag _started;
+  std::atomic<int> _pending;
+};
+
 class ChatServer {
 public:
-  ChatServer(int port);
+  ChatServer(const ServerOptions& options);
   ~ChatServer();
 
   void run();
 
   bool setClientName(const std::shared_ptr<ClientSession>& client, const std::string &name);
   void broadcast(ClientSession& sender, const std::shared_ptr<std::string>& msg);
+  void notifyMentions(ClientSession& sender, const std::string& line);
+  void addToHistory(ClientSession& sender, const std::string& line,
+		    const std::shared_ptr<std::string>& msg);
+  bool admitLine(ClientSession& sender, const std::string& line);
+  void search(ClientSession& client, const std::string& query);
+  void sendPrivate(ClientSession& sender, const std::string& args);
+  std::vector<std::shared_ptr<std::string> > peekMail(const std::string& name);
+  void ackMail(const std::string& name, const std::vector<std::shared_ptr<std::string> >& mail);
   void removeClient(std::shared_ptr<ClientSession>&& client);
   void shutdown();
+
+  // Null unless traffic capture was requested.
+  TrafficRecorder* recorder() {
+    return _recorder.get();
+  }
 private:
+  template <class Acceptor>
+  void acceptLoop(Acceptor& acceptor, bool shmRing = false);
+  void localAcceptThread(boost::asio::local::stream_protocol::acceptor& acceptor, bool shmRing);
   void reaperThread();
   std::shared_ptr<ClientSession> getClientToRemove();
+  void presenceThread();
 
   typedef std::map<const std::string*,
 		   std::shared_ptr<ClientSession>,
 		   PtrLess<std::string> >  NamesToClientsMap;
 
+  ServerOptions _options;
+  std::unique_ptr<TrafficRecorder> _recorder;
+  std::unique_ptr<MailboxStore> _mailboxes;
+  FloodFilter _floodFilter;
+  std::mutex _floodFilterMutex;
+  CpuAssigner _cpuAssigner;
   boost::asio::io_service _ioService;
   boost::asio::ip::tcp::acceptor _acceptor;
+  boost::asio::local::stream_protocol::acceptor _unixAcceptor;
+  std::thread _unixAcceptingThread;
+  boost::asio::local::stream_protocol::acceptor _shmAcceptor;
+  std::thread _shmAcceptingThread;
   std::mutex _clientsMutex;
   std::set<std::shared_ptr<ClientSession> > _clients;
+  AcceptController _acceptController;  // counts _clients, under _clientsMutex
+  std::condition_variable _admissionCondition;
   std::mutex _namesToClientsMutex;
   NamesToClientsMap  _namesToClients;
+  MentionMatcher _mentions;
+  ChatIndex _history;
+  PresenceBatcher _presence;
   std::mutex _clientsToRemoveMutex;
   std::deque<std::shared_ptr<ClientSession> > _clientsToRemove;
   std::condition_variable _reaperCondition;
+  std::unique_ptr<FanOutWorkers> _fanOut;
   std::thread _reaperThread;
+  std::mutex _presenceMutex;
+  std::condition_variable _presenceCondition;
+  std::thread _presenceThread;
   pthread_t _acceptingThreadId;
   std::atomic<bool> _isTerminating;
 };
 
-ClientSession::ClientSession(ChatServer& server, boost::asio::io_service &ioService) :
+// Session threads alive and their high-water mark, for comparing the session modes.
+static std::atomic<int> sessionThreads(0);
+static std::atomic<int> peakSessionThreads(0);
+
+static void countSessionThreads(int delta) {
+  int now = sessionThreads += delta;
+  int peak = peakSessionThreads.load();
+  while (now > peak && ! peakSessionThreads.compare_exchange_weak(peak, now));
+}
+
+// Writer wakeup latencies, from the sendMessage() that ended a wait to the writer running,
+// over all sessions. Striped by session, so writers rarely contend for a lock.
+class WakeupStats {
+public:
+  WakeupStats() :
+    _spins(0),
+    _parks(0) { }
+
+  void record(const void* session, uint64_t latencyNs) {
+    Stripe& stripe = _stripes[std::hash<const void*>()(session) % STRIPES];
+    std::lock_guard<std::mutex> guard(stripe.mutex);
+    stripe.latencies.record(latencyNs);
+  }
+
+  void addWaits(uint64_t spins, uint64_t parks) {
+    _spins += spins;
+    _parks += parks;
+  }
+
+  void print(std::ostream& stream) {
+    LatencyHistogram latencies;
+    for (auto& stripe : _stripes) {
+      std::lock_guard<std::mutex> guard(stripe.mutex);
+      latencies.merge(stripe.latencies);
+    }
+    if (latencies.count() == 0) {
+      return;
+    }
+    stream << "writer waits: " << _spins << " spun, " << _parks << " parked; wakeup latency:\n";
+    latencies.print(stream, "us", 1000.0);
+  }
+
+private:
+  enum {
+    STRIPES = 8
+  };
+
+  struct Stripe {
+    std::mutex mutex;
+    LatencyHistogram latencies;
+  };
+
+  Stripe _stripes[STRIPES];
+  std::atomic<uint64_t> _spins;
+  std::atomic<uint64_t> _parks;
+};
+
+static WakeupStats wakeupStats;
+
+// Bytes written to clients, and the zero-copy sends among them, for CPU per byte.
+static std::atomic<uint64_t> bytesWritten(0);
+static std::atomic<uint64_t> zeroCopySends(0);
+static std::atomic<uint64_t> zeroCopyKernelCopies(0);
+
+ClientSession::ClientSession(ChatServer& server, boost::asio::io_service &ioService,
+			     const ServerOptions& options) :
   _server(server),
   _socket(ioService),
   _nameValid(false),
-  _state(ALL_RUNNING) { }
+  _writerWait(uint64_t(options.writerSpinUsec) * 1000),
+  _eventFd(-1),
+  _outputFailed(false),
+  _zeroCopyThreshold(options.zeroCopyThreshold),
+  _cpu(-1),
+  _state(ALL_RUNNING),
+  _captureId(0) {
+  if (options.pollSessions) {
+    _eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (_eventFd < 0) {
+      throw std::system_error(errno, std::system_category(), "eventfd");
+    }
+  }
+}
+
+ClientSession::~ClientSession() {
+  if (_eventFd >= 0) {
+    close(_eventFd);
+  }
+}
 
 
-void ClientSession::start() {
+// Before start(): from now on the client's bytes go through a shared memory ring, handed to
+// it over the socket. Ring waits are futex waits rather than poll(), so these sessions always
+// get a reader and a writer thread.
+void ClientSession::attachRing() {
+  _ring = ShmRingStream::serve(_socket.native_handle());
+  if (_eventFd >= 0) {
+    close(_eventFd);
+    _eventFd = -1;
+  }
+}
+
+void ClientSession::start(int cpu) {
+  record(CaptureEvent::CONNECT);
+  _cpu = cpu;
   _readerThread = std::thread(std::bind(&ClientSession::readerThread, this));
-  _writerThread = std::thread(std::bind(&ClientSession::writerThread, this));
+  if (_eventFd < 0) {
+    _writerThread = std::thread(std::bind(&ClientSession::writerThread, this));
+  }
+  countSessionThreads(_eventFd < 0 ? 2 : 1);
+}
+
+// First thing in the reader and the writer: they hand messages to each other through the
+// socket and _messages, so both go to the same CPU. Each pins itself, as the accept thread
+// can't touch their handles safely once they run. Not pinned is slower, not broken.
+void ClientSession::pinToCpu() {
+  if (_cpu < 0) {
+    return;
+  }
+  try {
+    pinCurrentThreadToCpu(_cpu);
+  }
+  catch (std::exception& ex) {
+    std::cout << "Pinning client thread to CPU " << _cpu << " failed: " << ex.what() << std::endl;
+  }
 }
 
 void ClientSession::sendMessage(const std::shared_ptr<std::string>& msg) {
-  std::lock_guard<std::mutex> guard(_messagesMutex);
+  std::unique_lock<std::mutex> lock(_messagesMutex);
+  bool wasEmpty = _messages.empty();
   _messages.push_back(msg);
-  _writerCondition.notify_one();
+  if (_eventFd < 0) {
+    _writerWait.notify();
+  }
+  else if (wasEmpty) {
+    // Later messages ride on this wakeup: the poller takes the whole queue at once.
+    lock.unlock();
+    wakePoller();
+  }
 }
 
 void ClientSession::waitToFinish() {
-  int state = _state.load();
-  assert(state & READER_TERMINATED);
-  assert(state & WRITER_TERMINATED);
+  assert((_state.load() & (READER_TERMINATED | WRITER_TERMINATED)) ==
+	 (READER_TERMINATED | WRITER_TERMINATED));
 
-  _readerThread.join();
-  _writerThread.join();
+  {
+    // shutdown() may be signalling the reader; a joined thread's handle is gone.
+    std::lock_guard<std::mutex> guard(_readerJoinMutex);
+    _readerThread.join();
+  }
+  if (_writerThread.joinable()) {
+    _writerThread.join();
+  }
+  countSessionThreads(_eventFd < 0 ? -2 : -1);
 }
 
 static const char str[] = "What's your name?\n";
 
 void ClientSession::readerThread() {
+  pinToCpu();
   try {
     bool loginSuccessfull = false;
+    std::string name;
     while (! loginSuccessfull && _state == ALL_RUNNING) {
-      boost::asio::write(_socket, boost::asio::buffer(str, sizeof(str)-1));
-      std::string name = readLineFromClient();
+      writeToClient(boost::asio::buffer(str, sizeof(str)-1));
+      if (! readLine(name)) {
+	break;
+      }
+      record(CaptureEvent::NAME, name);
       if ((loginSuccessfull = _server.setClientName(shared_from_this(), name))) {
 	std::string response = "Welcome to the chat, " + name + "!\n";
-	boost::asio::write(_socket, boost::asio::buffer(response));
+	// Messages left while the user was away go out in the same write as the greeting.
+	auto mail = _server.peekMail(name);
+	std::vector<boost::asio::const_buffer> buffers{ boost::asio::buffer(response) };
+	for (const auto& msg : mail) {
+	  buffers.push_back(boost::asio::buffer(*msg));
+	}
+	writeToClient(buffers);
+	_server.ackMail(name, mail);
       }
       else {
 	std::string response = "Name '" + name + "' is already taken, invent another one.\n";
-	boost::asio::write(_socket, boost::asio::buffer(response));
+	writeToClient(boost::asio::buffer(response));
       }
     }
 
-    while (parseLine(readLineFromClient()));
+    std::string line;
+    while (loginSuccessfull && readLine(line) && parseLine(line));
   }
   catch (std::exception& ex) {
     const std::string *name = getName();
@@ -173,15 +453,123 @@ void ClientSession::readerThread() {
   onReaderShutdown();
 }
 
+// False when a polling session was told to terminate; the threaded reader gets interrupted
+// by a signal instead.
+bool ClientSession::readLine(std::string& line) {
+  if (_eventFd >= 0) {
+    return pollLine(line);
+  }
+  line = readLineFromClient();
+  return true;
+}
+
 std::string ClientSession::readLineFromClient() {
-  boost::asio::read_until(_socket, _inputBuffer, '\n');
+  AllocScope readScope(AllocTag::READ);
+  if (_ring) {
+    boost::asio::read_until(*_ring, _inputBuffer, '\n');
+  }
+  else {
+    boost::asio::read_until(_socket, _inputBuffer, '\n');
+  }
   std::istream stream(&_inputBuffer);
   std::string line;
   std::getline(stream, line);
   return line;
 }
 
+template <class Buffers>
+void ClientSession::writeToClient(const Buffers& buffers) {
+  if (_ring) {
+    boost::asio::write(*_ring, buffers);
+  }
+  else {
+    boost::asio::write(_socket, buffers);
+  }
+}
+
+// The reader and the writer in one thread: waits on the socket and the eventfd together,
+// writing out queued messages until a whole line has arrived.
+bool ClientSession::pollLine(std::string& line) {
+  AllocScope readScope(AllocTag::READ);
+  pollfd fds[2];
+  fds[0].fd = _socket.native_handle();
+  fds[0].events = POLLIN;
+  fds[1].fd = _eventFd;
+  fds[1].events = POLLIN;
+  while (! (_state & READER_TERMINATION_REQUESTED)) {
+    auto input = _inputBuffer.data();
+    const char* begin = static_cast<const char*>(input.data());
+    const char* newline = static_cast<const char*>(memchr(begin, '\n', input.size()));
+    if (newline) {
+      line.assign(begin, newline);
+      _inputBuffer.consume(newline - begin + 1);
+      return true;
+    }
+    if (poll(fds, 2, -1) < 0) {
+      if (errno == EINTR) {
+	continue;
+      }
+      throw std::system_error(errno, std::system_category(), "poll");
+    }
+    if (fds[1].revents & POLLIN) {
+      uint64_t count;
+      if (read(_eventFd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+	throw std::system_error(errno, std::system_category(), "eventfd read");
+      }
+      if (! writeQueuedMessages()) {
+	break;
+      }
+    }
+    if (fds[0].revents) {
+      // Readable, hung up or failed: either way read_some returns without blocking.
+      _inputBuffer.commit(_socket.read_some(_inputBuffer.prepare(POLL_READ_SIZE)));
+    }
+  }
+  return false;
+}
+
+// Takes the whole queue and writes it in one gather write. False once the session is
+// terminating. After a failed write, output is discarded but input is still served until end
+// of file, so lines the client sent before going away (a final /shutdown, say) are handled
+// just as the separate reader thread would.
+bool ClientSession::writeQueuedMessages() {
+  {
+    std::lock_guard<std::mutex> guard(_messagesMutex);
+    if (_state != ALL_RUNNING) {
+      return false;
+    }
+    _sending.swap(_messages);
+  }
+  AllocScope writeScope(AllocTag::WRITE);
+  if (! _outputFailed) {
+    _sendBuffers.clear();
+    for (const auto& msg : _sending) {
+      _sendBuffers.push_back(boost::asio::buffer(*msg));
+    }
+    try {
+      bytesWritten += boost::asio::write(_socket, _sendBuffers);
+    }
+    catch (std::exception& ex) {
+      const std::string *name = getName();
+      std::string formattedName = name ? "'" + *name + "'" : "(null)";
+      std::cout << "Client " << formattedName << " write exeption: " << ex.what() << std::endl;
+      _outputFailed = true;
+    }
+  }
+  _sending.clear();
+  return true;
+}
+
+void ClientSession::wakePoller() {
+  uint64_t one = 1;
+  if (write(_eventFd, &one, sizeof(one)) < 0 && errno != EAGAIN) {
+    throw std::system_error(errno, std::system_category(), "eventfd write");
+  }
+}
+
 bool ClientSession::parseLine(const std::string& line) {
+  AllocScope parseScope(AllocTag::PARSE);
+  record(CaptureEvent::LINE, line);
   if (line == "/quit") {
     return false;
   }
@@ -189,32 +577,92 @@ bool ClientSession::parseLine(const std::string& line) {
     _server.shutdown();
     return false;
   }
+  else if (line.compare(0, 5, "/msg ") == 0) {
+    _server.sendPrivate(*this, line.substr(5));
+    return true;
+  }
+  else if (line.compare(0, 8, "/search ") == 0) {
+    _server.search(*this, line.substr(8));
+    return true;
+  }
+  else if (! _server.admitLine(*this, line)) {
+    return true;
+  }
   else {
-    std::ostringstream stream;
-    stream << boost::posix_time::microsec_clock::local_time() << ' '
-	   << _name << ": " << line << std::endl;
-    _server.broadcast(*this, std::make_shared<std::string>(stream.str()));
+    countAllocProfiledMessage();
+    std::shared_ptr<std::string> msg;
+    {
+      AllocScope formatScope(AllocTag::FORMAT);
+      msg = std::make_shared<std::string>();
+      msg->reserve(LOCAL_TIMESTAMP_SIZE + _name.size() + line.size() + 4);
+      appendLocalTimestamp(*msg, TscClock::instance().realtimeNow());
+      *msg += ' ';
+      *msg += _name;
+      *msg += ": ";
+      *msg += line;
+      *msg += '\n';
+    }
+    AllocScope broadcastScope(AllocTag::BROADCAST);
+    _server.broadcast(*this, msg);
+    _server.addToHistory(*this, line, msg);
+    _server.notifyMentions(*this, line);
     return true;
   }
 }
 
+void ClientSession::record(CaptureEvent event, const std::string& payload) {
+  TrafficRecorder* recorder = _server.recorder();
+  if (recorder) {
+    if (event == CaptureEvent::CONNECT) {
+      _captureId = recorder->newSession();
+    }
+    if (_captureId) {
+      recorder->record(event, _captureId, payload);
+    }
+  }
+}
+
+// The client is gone (or told to go) once its reader stops, not when the reaper gets to it.
 void ClientSession::onReaderShutdown() {
+  record(CaptureEvent::DISCONNECT);
+  if (_eventFd >= 0) {
+    // A polling session has no writer thread to wait for.
+    _state.fetch_or(READER_TERMINATED | WRITER_TERMINATED);
+    _server.removeClient(shared_from_this());
+    return;
+  }
   int oldValue = _state.fetch_or(READER_TERMINATED);
   if (oldValue & WRITER_TERMINATED) {
     _server.removeClient(shared_from_this());
   }
   else {
-    _writerCondition.notify_one();
+    std::lock_guard<std::mutex> guard(_messagesMutex);
+    _writerWait.notify();
   }
 }    
 
 void ClientSession::writerThread() {
+  pinToCpu();
+  std::unique_ptr<ZeroCopySender> zeroCopy;
+  if (_zeroCopyThreshold > 0 && ! _ring) {
+    zeroCopy.reset(new ZeroCopySender(_socket.native_handle()));
+    if (! zeroCopy->enabled()) {
+      zeroCopy.reset();
+    }
+  }
   try {
     bool run = true;
     while (run) {
       auto msg = getMessage();
       if (msg) {
-	boost::asio::write(_socket, boost::asio::buffer(*msg));
+	AllocScope writeScope(AllocTag::WRITE);
+	if (zeroCopy && msg->size() >= _zeroCopyThreshold) {
+	  zeroCopy->send(msg);
+	}
+	else {
+	  writeToClient(boost::asio::buffer(*msg));
+	}
+	bytesWritten += msg->size();
       }
       else {
 	run = false;
@@ -227,12 +675,23 @@ void ClientSession::writerThread() {
     std::cout << "Client " << formattedName << " writer thread exeption: " << ex.what() << std::endl;
   }
 
+  if (zeroCopy) {
+    zeroCopy->drain();
+    zeroCopySends += zeroCopy->sends();
+    zeroCopyKernelCopies += zeroCopy->kernelCopies();
+  }
+  wakeupStats.addWaits(_writerWait.spins(), _writerWait.parks());
   onWriterShutdown();
 }
 
 std::shared_ptr<std::string> ClientSession::getMessage() {
   std::unique_lock<std::mutex> lock(_messagesMutex);
-  _writerCondition.wait(lock, [this]() { return _state != ALL_RUNNING || ! _messages.empty(); });
+  uint64_t latency = _writerWait.wait(lock, [this]() {
+      return _state != ALL_RUNNING || ! _messages.empty();
+    });
+  if (latency) {
+    wakeupStats.record(this, latency);
+  }
   if (_state != ALL_RUNNING) {
     return std::shared_ptr<std::string>();
   }
@@ -255,33 +714,253 @@ void ClientSession::onWriterShutdown() {
 
 void ClientSession::interruptReader() {
   _state.fetch_or(READER_TERMINATION_REQUESTED);
-  pthread_kill(_readerThread.native_handle(), SIGUSR1);
+  if (_ring) {
+    _ring->close();
+  }
+  else {
+    std::lock_guard<std::mutex> guard(_readerJoinMutex);
+    if (_readerThread.joinable()) {
+      pthread_kill(_readerThread.native_handle(), SIGUSR1);
+    }
+  }
 }
 
 void ClientSession::terminate() {
-  interruptReader();
+  if (_eventFd >= 0) {
+    _state.fetch_or(READER_TERMINATION_REQUESTED);
+    wakePoller();
+  }
+  else {
+    interruptReader();
+  }
+}
+
+FanOutWorkers::FanOutWorkers(int workers) :
+  _pending(0) {
+  for (int i = 0; i < workers; ++i) {
+    _workers.emplace_back(new Worker);
+  }
+}
+
+FanOutWorkers::~FanOutWorkers() {
+  for (auto& worker : _workers) {
+    std::lock_guard<std::mutex> guard(worker->jobsMutex);
+    worker->stopping = true;
+    worker->jobsCondition.notify_one();
+  }
+  for (auto& worker : _workers) {
+    if (worker->thread.joinable()) {
+      worker->thread.join();
+    }
+  }
+}
+
+void FanOutWorkers::start() {
+  for (auto& worker : _workers) {
+    worker->thread = std::thread(std::bind(&FanOutWorkers::workerThread, this, std::ref(*worker)));
+  }
+}
+
+FanOutWorkers::Worker& FanOutWorkers::workerFor(const std::shared_ptr<ClientSession>& client) {
+  return *_workers[std::hash<std::string>()(*client->getName()) % _workers.size()];
+}
+
+void FanOutWorkers::addClient(const std::shared_ptr<ClientSession>& client) {
+  Worker& worker = workerFor(client);
+  std::lock_guard<std::mutex> guard(worker.clientsMutex);
+  worker.clients.push_back(client);
+}
+
+void FanOutWorkers::removeClient(const std::shared_ptr<ClientSession>& client) {
+  Worker& worker = workerFor(client);
+  std::lock_guard<std::mutex> guard(worker.clientsMutex);
+  auto found = std::find(worker.clients.begin(), worker.clients.end(), client);
+  if (found != worker.clients.end()) {
+    std::swap(*found, worker.clients.back());
+    worker.clients.pop_back();
+  }
+}
+
+void FanOutWorkers::broadcast(ClientSession& sender, const std::shared_ptr<std::string>& msg) {
+  pushToAll(Job{ sender.shared_from_this(), msg, nullptr });
+}
+
+void FanOutWorkers::broadcastToAll(const std::shared_ptr<std::string>& msg) {
+  pushToAll(Job{ nullptr, msg, nullptr });
+}
+
+void FanOutWorkers::pushToAll(const Job& job) {
+  std::call_once(_started, &FanOutWorkers::start, this);
+  _pending += _workers.size();
+  for (auto& worker : _workers) {
+    std::lock_guard<std::mutex> guard(worker->jobsMutex);
+    worker->jobs.push_back(job);
+    worker->jobsCondition.notify_one();
+  }
+}
+
+void FanOutWorkers::sendTo(const std::shared_ptr<ClientSession>& receiver,
+			   const std::shared_ptr<std::string>& msg) {
+  if (! busy()) {
+    receiver->sendMessage(msg);
+    return;
+  }
+  Worker& worker = workerFor(receiver);
+  ++_pending;
+  std::lock_guard<std::mutex> guard(worker.jobsMutex);
+  worker.jobs.push_back(Job{ nullptr, msg, receiver });
+  worker.jobsCondition.notify_one();
+}
+
+void FanOutWorkers::workerThread(Worker& worker) {
+  Job job;
+  while (getJob(worker, job)) {
+    if (job.target) {
+      job.target->sendMessage(job.msg);
+    }
+    else {
+      std::lock_guard<std::mutex> guard(worker.clientsMutex);
+      for (const auto& receiver : worker.clients) {
+	if (receiver != job.sender) {
+	  receiver->sendMessage(job.msg);
+	}
+      }
+    }
+    job = Job();
+    --_pending;
+  }
+}
+
+bool FanOutWorkers::getJob(Worker& worker, Job& job) {
+  std::unique_lock<std::mutex> lock(worker.jobsMutex);
+  worker.jobsCondition.wait(lock, [&worker]() { return worker.stopping || ! worker.jobs.empty(); });
+  if (worker.stopping) {
+    return false;
+  }
+  job = std::move(worker.jobs.front());
+  worker.jobs.pop_front();
+  return true;
 }
 
-ChatServer::ChatServer(int port) :
-  _acceptor(_ioService, boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), port)),
+ChatServer::ChatServer(const ServerOptions& options) :
+  _options(options),
+  _recorder(options.recordPath.empty() ? nullptr : new TrafficRecorder(options.recordPath)),
+  _mailboxes(options.mailboxPath.empty() ? nullptr : new MailboxStore(options.mailboxPath)),
+  _floodFilter(options.floodLimit, std::chrono::seconds(options.floodWindowSec)),
+  _cpuAssigner(options.cpus),
+  _acceptor(_ioService, boost::asio::ip::tcp::endpoint(boost::asio::ip::tcp::v4(), options.port)),
+  _unixAcceptor(_ioService),
+  _shmAcceptor(_ioService),
+  _acceptController(options.maxConnections),
+  _fanOut(options.fanOutThreshold == 0 ? nullptr :
+	  new FanOutWorkers(options.fanOutWorkers > 0 ? options.fanOutWorkers :
+			    std::max(1u, std::thread::hardware_concurrency()))),
   _reaperThread(std::bind(&ChatServer::reaperThread, this)),
   _isTerminating(false) { }
 
 
 ChatServer::~ChatServer() {
   _reaperThread.join();
+  if (_presenceThread.joinable()) {
+    _presenceThread.join();
+  }
+  if (_unixAcceptingThread.joinable()) {
+    _unixAcceptingThread.join();
+  }
+  if (_shmAcceptingThread.joinable()) {
+    _shmAcceptingThread.join();
+  }
 }
 
 void ChatServer::run() {
   _acceptingThreadId = pthread_self();
+  if (! _options.unixPath.empty()) {
+    openUnixAcceptor(_unixAcceptor, _options.unixPath);
+    _unixAcceptingThread = std::thread(std::bind(&ChatServer::localAcceptThread, this,
+						 std::ref(_unixAcceptor), false));
+  }
+  if (! _options.shmPath.empty()) {
+    openUnixAcceptor(_shmAcceptor, _options.shmPath);
+    _shmAcceptingThread = std::thread(std::bind(&ChatServer::localAcceptThread, this,
+						std::ref(_shmAcceptor), true));
+  }
+  if (_options.presenceIntervalMs > 0) {
+    _presenceThread = std::thread(std::bind(&ChatServer::presenceThread, this));
+  }
+  acceptLoop(_acceptor);
+}
+
+void ChatServer::localAcceptThread(boost::asio::local::stream_protocol::acceptor& acceptor,
+				   bool shmRing) {
+  try {
+    acceptLoop(acceptor, shmRing);
+  }
+  catch (std::exception& ex) {
+    std::cout << "Unix accept thread exception: " << ex.what() << std::endl;
+  }
+}
+
+template <class Acceptor>
+void ChatServer::acceptLoop(Acceptor& acceptor, bool shmRing) {
   while (! _isTerminating) {
-    std::shared_ptr<ClientSession> client = std::make_shared<ClientSession>(*this, _ioService);
-    _acceptor.accept(client->socket());
+    {
+      std::unique_lock<std::mutex> lock(_clientsMutex);
+      _admissionCondition.wait(lock, [this]() {
+	  return _isTerminating || _acceptController.admitting();
+	});
+    }
+    if (_isTerminating) {
+      break;
+    }
+    std::shared_ptr<ClientSession> client;
+    boost::system::error_code error;
+    std::string what;
+    try {
+      client = std::make_shared<ClientSession>(*this, _ioService, _options);
+      acceptor.accept(client->socket());
+    }
+    catch (boost::system::system_error& ex) {
+      error = ex.code();
+      what = ex.what();
+    }
+    catch (std::system_error& ex) {
+      // From the session: a polling one needs an eventfd, so it too can run out of descriptors.
+      error.assign(ex.code().value(), boost::system::system_category());
+      what = ex.what();
+    }
+    if (error) {
+      // shutdown() interrupts accept() with SIGUSR1: the normal way out, not a failure.
+      if (_isTerminating) {
+	break;
+      }
+      auto delay = _acceptController.failed(error, acceptor.native_handle());
+      std::cout << "Accept error: " << what << ", retrying in " << delay.count() << " ms"
+		<< std::endl;
+      std::unique_lock<std::mutex> lock(_clientsMutex);
+      _admissionCondition.wait_for(lock, delay, [this]() { return _isTerminating.load(); });
+      continue;
+    }
+    if (shmRing) {
+      try {
+	client->attachRing();
+      }
+      catch (std::exception& ex) {
+	std::cout << "Shared memory handshake failed: " << ex.what() << std::endl;
+	continue;
+      }
+    }
+    if (_options.busyPollUsec > 0) {
+      enableBusyPoll(client->socket().native_handle(), _options.busyPollUsec);
+    }
     std::lock_guard<std::mutex> guard(_clientsMutex);
     if (! _isTerminating) {
-      auto p = _clients.insert(client);
-      assert(p.second);
-      client->start();
+      _clients.insert(client);
+      _acceptController.connectionOpened();
+      client->start(_cpuAssigner.enabled() ? _cpuAssigner.next() : -1);
+      if (! _acceptController.admitting()) {
+	std::cout << "Accepting paused at " << _acceptController.maxConnections()
+		  << " connections" << std::endl;
+      }
     }
   }
 }
@@ -292,8 +971,14 @@ bool ChatServer::setClientName(const std::shared_ptr<ClientSession>& client,
   NamesToClientsMap::iterator found = _namesToClients.find(&name);
   if (found == _namesToClients.end()) {
     client->setName(name);
-    auto res = _namesToClients.insert(std::make_pair(client->getName(), client));
-    assert(res.second);
+    _namesToClients.emplace(client->getName(), client);
+    _mentions.add(name);
+    if (_options.presenceIntervalMs > 0) {
+      _presence.joined(name);
+    }
+    if (_fanOut) {
+      _fanOut->addClient(client);
+    }
     return true;
   }
   else {
@@ -303,6 +988,18 @@ bool ChatServer::setClientName(const std::shared_ptr<ClientSession>& client,
 
 void ChatServer::broadcast(ClientSession& sender,
 			   const std::shared_ptr<std::string>& msg) {
+  if (_fanOut) {
+    bool largeRoom;
+    {
+      std::lock_guard<std::mutex> guard(_namesToClientsMutex);
+      largeRoom = _namesToClients.size() >= _options.fanOutThreshold;
+    }
+    if (largeRoom || _fanOut->busy()) {
+      _fanOut->broadcast(sender, msg);
+      return;
+    }
+  }
+
   std::vector<std::shared_ptr<ClientSession> > clients;
   {
     std::lock_guard<std::mutex> guard(_namesToClientsMutex);
@@ -318,6 +1015,121 @@ void ChatServer::broadcast(ClientSession& sender,
   }
 }
 
+void ChatServer::notifyMentions(ClientSession& sender, const std::string& line) {
+  std::vector<std::shared_ptr<ClientSession> > mentioned;
+  {
+    std::lock_guard<std::mutex> guard(_namesToClientsMutex);
+    std::vector<std::string> names;
+    _mentions.scan(line, names);
+    for (const auto& name : names) {
+      NamesToClientsMap::iterator found = _namesToClients.find(&name);
+      if (found != _namesToClients.end() && found->second.get() != &sender) {
+	mentioned.push_back(found->second);
+      }
+    }
+  }
+  if (mentioned.empty()) {
+    return;
+  }
+  auto msg = std::make_shared<std::string>("*** " + *sender.getName() + " mentioned you\n");
+  for (const auto& receiver : mentioned) {
+    if (_fanOut) {
+      _fanOut->sendTo(receiver, msg);
+    }
+    else {
+      receiver->sendMessage(msg);
+    }
+  }
+}
+
+bool ChatServer::admitLine(ClientSession& sender, const std::string& line) {
+  if (! _floodFilter.enabled()) {
+    return true;
+  }
+  {
+    std::lock_guard<std::mutex> guard(_floodFilterMutex);
+    if (_floodFilter.admit(line)) {
+      return true;
+    }
+  }
+  sender.sendMessage(std::make_shared<std::string>("*** Repeated message dropped\n"));
+  return false;
+}
+
+void ChatServer::addToHistory(ClientSession& sender, const std::string& line,
+			      const std::shared_ptr<std::string>& msg) {
+  _history.add(msg, *sender.getName() + ' ' + line);
+}
+
+void ChatServer::search(ClientSession& client, const std::string& query) {
+  auto lines = _history.search(query, ChatIndex::MAX_RESULTS);
+  auto msg = std::make_shared<std::string>("*** " + boost::lexical_cast<std::string>(lines.size())
+					   + " matches for " + query + '\n');
+  for (const auto& line : lines) {
+    *msg += *line;
+  }
+  if (_fanOut) {
+    _fanOut->sendTo(client.shared_from_this(), msg);
+  }
+  else {
+    client.sendMessage(msg);
+  }
+}
+
+void ChatServer::sendPrivate(ClientSession& sender, const std::string& args) {
+  size_t space = args.find(' ');
+  if (space == std::string::npos || space == 0) {
+    sender.sendMessage(std::make_shared<std::string>("*** Usage: /msg <name> <text>\n"));
+    return;
+  }
+  std::string name = args.substr(0, space);
+  std::string text;
+  appendLocalTimestamp(text, TscClock::instance().realtimeNow());
+  text += ' ' + *sender.getName() + " -> " + name + ": " + args.substr(space + 1) + '\n';
+
+  std::shared_ptr<ClientSession> receiver;
+  bool saved = false;
+  {
+    std::lock_guard<std::mutex> guard(_namesToClientsMutex);
+    NamesToClientsMap::iterator found = _namesToClients.find(&name);
+    if (found != _namesToClients.end()) {
+      receiver = found->second;
+    }
+    else if (_mailboxes) {
+      // Under the lock, so the user can't log in between the lookup and the deposit.
+      saved = _mailboxes->deposit(name, text);
+    }
+  }
+  if (receiver) {
+    auto msg = std::make_shared<std::string>(text);
+    if (_fanOut) {
+      _fanOut->sendTo(receiver, msg);
+    }
+    else {
+      receiver->sendMessage(msg);
+    }
+  }
+  else if (_mailboxes) {
+    sender.sendMessage(std::make_shared<std::string>("*** " + name + " is offline, message " +
+						     (saved ? "saved\n" : "not saved\n")));
+  }
+  else {
+    sender.sendMessage(std::make_shared<std::string>("*** " + name + " is not online\n"));
+  }
+}
+
+std::vector<std::shared_ptr<std::string> > ChatServer::peekMail(const std::string& name) {
+  return _mailboxes ? _mailboxes->peek(name) : std::vector<std::shared_ptr<std::string> >();
+}
+
+// Once the mail from peekMail() has been written to the client.
+void ChatServer::ackMail(const std::string& name,
+			 const std::vector<std::shared_ptr<std::string> >& mail) {
+  if (_mailboxes && ! mail.empty()) {
+    _mailboxes->ack(name, mail);
+  }
+}
+
 void ChatServer::removeClient(std::shared_ptr<ClientSession>&& client) {
   std::lock_guard<std::mutex> guard(_clientsToRemoveMutex);
   _clientsToRemove.push_back(std::move(client));
@@ -331,12 +1143,23 @@ void ChatServer::reaperThread() {
       client->waitToFinish();
       {
 	std::lock_guard<std::mutex> guard(_namesToClientsMutex);
-	_namesToClients.erase(client->getName());
+	size_t erased = _namesToClients.erase(client->getName());
+	if (erased) {
+	  _mentions.remove(*client->getName());
+	  if (_options.presenceIntervalMs > 0) {
+	    _presence.left(*client->getName());
+	  }
+	  if (_fanOut) {
+	    _fanOut->removeClient(client);
+	  }
+	}
       }
       {
 	std::lock_guard<std::mutex> guard(_clientsMutex);
-	size_t res = _clients.erase(client);
-	assert(res == 1);
+	if (_clients.erase(client) == 1) {
+	  _acceptController.connectionClosed();
+	  _admissionCondition.notify_all();
+	}
 	if (_isTerminating && _clients.empty()) {
 	  break;
 	}
@@ -348,6 +1171,36 @@ void ChatServer::reaperThread() {
   }
 }
 
+void ChatServer::presenceThread() {
+  std::unique_lock<std::mutex> lock(_presenceMutex);
+  auto interval = std::chrono::milliseconds(_options.presenceIntervalMs);
+  while (! _presenceCondition.wait_for(lock, interval, [this]() { return _isTerminating.load(); })) {
+    std::string summary;
+    std::vector<std::shared_ptr<ClientSession> > clients;
+    bool fanOut;
+    {
+      std::lock_guard<std::mutex> guard(_namesToClientsMutex);
+      summary = _presence.flush();
+      fanOut = _fanOut && (_namesToClients.size() >= _options.fanOutThreshold || _fanOut->busy());
+      if (! summary.empty() && ! fanOut) {
+	for (const auto& kvPair : _namesToClients) {
+	  clients.push_back(kvPair.second);
+	}
+      }
+    }
+    if (summary.empty()) {
+      continue;
+    }
+    auto msg = std::make_shared<std::string>(std::move(summary));
+    if (fanOut) {
+      _fanOut->broadcastToAll(msg);
+    }
+    for (const auto& client : clients) {
+      client->sendMessage(msg);
+    }
+  }
+}
+
 std::shared_ptr<ClientSession> ChatServer::getClientToRemove() {
   std::unique_lock<std::mutex> lock(_clientsToRemoveMutex);
   _reaperCondition.wait(lock, [this]() { return ! _clientsToRemove.empty(); });
@@ -362,8 +1215,46 @@ void ChatServer::shutdown() {
     client->terminate();
   }
   _isTerminating = true;
+  _admissionCondition.notify_all();
   lock.unlock();
+  {
+    std::lock_guard<std::mutex> guard(_presenceMutex);
+    _presenceCondition.notify_one();
+  }
   pthread_kill(_acceptingThreadId, SIGUSR1);
+  if (_unixAcceptingThread.joinable()) {
+    pthread_kill(_unixAcceptingThread.native_handle(), SIGUSR1);
+  }
+  if (_shmAcceptingThread.joinable()) {
+    pthread_kill(_shmAcceptingThread.native_handle(), SIGUSR1);
+  }
+}
+
+// Peak session threads, memory and context switches over the server's life. getrusage() also
+// counts the threads that have exited; VmPeak shows the address space their stacks reserved.
+static void reportUsage(std::ostream& stream) {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  std::string vmPeak = "?";
+  std::ifstream status("/proc/self/status");
+  for (std::string line; std::getline(status, line); ) {
+    if (line.compare(0, 7, "VmPeak:") == 0) {
+      vmPeak = line.substr(line.find_first_not_of(" \t", 7));
+    }
+  }
+  stream << "peak session threads " << peakSessionThreads << ", max RSS " << usage.ru_maxrss
+	 << " kB, VmPeak " << vmPeak << ", context switches " << usage.ru_nvcsw
+	 << " voluntary + " << usage.ru_nivcsw << " involuntary" << std::endl;
+  double cpuNs = (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1e9
+    + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) * 1e3;
+  stream << "wrote " << bytesWritten << " bytes to clients, " << std::fixed << std::setprecision(3)
+	 << (bytesWritten ? cpuNs / bytesWritten : 0.0) << " CPU ns per byte";
+  if (zeroCopySends) {
+    stream << ", " << zeroCopySends << " zero-copy sends (" << zeroCopyKernelCopies
+	   << " copied by the kernel)";
+  }
+  stream << std::endl;
+  wakeupStats.print(stream);
 }
 
 static void handler(int) { }
@@ -377,17 +1268,34 @@ int main(int argc, char **argv) {
     return 1;
   }
   
+  ServerOptions options;
   try {
-    if (argc < 2) {
-      std::cerr << "Usage: " << argv[0] << " <port>\n";
-      return 1;
+    options = parseServerOptions(argc, argv);
+    if (options.spin) {
+      throw std::invalid_argument("--spin needs an event loop; the threaded server has none");
     }
-    ChatServer server(boost::lexical_cast<int>(argv[1]));
+  }
+  catch (std::exception &ex) {
+    std::cerr << ex.what() << std::endl;
+    printServerUsage(std::cerr, argv[0]);
+    return 1;
+  }
+
+  // Calibrating the clock busy-waits 20 ms: done here rather than by the first message.
+  TscClock::instance();
+  int status = 0;
+  try {
+    ChatServer server(options);
     server.run();
-    return 0;
   }
   catch (std::exception &ex) {
     std::cerr << "Main thread exception: " << ex.what() << std::endl;
-    return 1;
+    status = 1;
+  }
+  // After the server is gone, so its threads' allocations are all in.
+  reportUsage(std::cout);
+  if (! reportAllocations(std::cout)) {
+    status = 1;
   }
+  return status;
 }
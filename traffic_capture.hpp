@@ -0,0 +1,136 @@
+#ifndef TRAFFIC_CAPTURE_HPP
+#define TRAFFIC_CAPTURE_HPP
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+
+// Capture file: the magic "CHATCAP1" followed by records of
+//   type (1 byte), session id, nanoseconds since the previous record, payload length, payload
+// where all three integers are LEB128 varints. A line typed by a chat user costs about
+// 4 bytes of overhead on top of its text.
+enum class CaptureEvent : uint8_t {
+  CONNECT = 1,
+  NAME = 2,
+  LINE = 3,
+  DISCONNECT = 4
+};
+
+static const char CAPTURE_MAGIC[] = "CHATCAP1";
+
+struct CaptureRecord {
+  CaptureEvent type;
+  uint32_t session;
+  uint64_t timestamp;  // nanoseconds since the start of the capture
+  std::string payload;
+};
+
+// Thread-safe: sessions of the threaded server record from their own reader threads.
+// Records go to an ofstream buffer and reach the disk in large writes.
+class TrafficRecorder {
+public:
+  explicit TrafficRecorder(const std::string& path) :
+    _file(path, std::ios::binary | std::ios::trunc),
+    _start(std::chrono::steady_clock::now()),
+    _last(0),
+    _nextSession(1) {
+    if (! _file) {
+      throw std::runtime_error("can't open capture file " + path);
+    }
+    _file.write(CAPTURE_MAGIC, sizeof(CAPTURE_MAGIC) - 1);
+  }
+
+  // Session ids start at 1, so 0 can mean "not recorded".
+  uint32_t newSession() {
+    std::lock_guard<std::mutex> guard(_mutex);
+    return _nextSession++;
+  }
+
+  void record(CaptureEvent type, uint32_t session, const std::string& payload = std::string()) {
+    uint64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+      std::chrono::steady_clock::now() - _start).count();
+    std::lock_guard<std::mutex> guard(_mutex);
+    // Recording threads may race between reading the clock and taking the lock.
+    uint64_t delta = now > _last ? now - _last : 0;
+    _last += delta;
+    _file.put(static_cast<char>(type));
+    writeVarint(session);
+    writeVarint(delta);
+    writeVarint(payload.size());
+    _file.write(payload.data(), payload.size());
+  }
+
+  void flush() {
+    std::lock_guard<std::mutex> guard(_mutex);
+    _file.flush();
+  }
+
+private:
+  void writeVarint(uint64_t value) {
+    while (value >= 0x80) {
+      _file.put(static_cast<char>(value | 0x80));
+      value >>= 7;
+    }
+    _file.put(static_cast<char>(value));
+  }
+
+  std::mutex _mutex;
+  std::ofstream _file;
+  std::chrono::steady_clock::time_point _start;
+  uint64_t _last;
+  uint32_t _nextSession;
+};
+
+class TrafficReader {
+public:
+  explicit TrafficReader(const std::string& path) :
+    _file(path, std::ios::binary),
+    _timestamp(0) {
+    char magic[sizeof(CAPTURE_MAGIC) - 1];
+    if (! _file.read(magic, sizeof(magic)) ||
+	std::string(magic, sizeof(magic)) != std::string(CAPTURE_MAGIC, sizeof(magic))) {
+      throw std::runtime_error(path + " is not a capture file");
+    }
+  }
+
+  // Returns false at the end of the capture; throws on a truncated record.
+  bool next(CaptureRecord& record) {
+    int type = _file.get();
+    if (type == std::char_traits<char>::eof()) {
+      return false;
+    }
+    record.type = static_cast<CaptureEvent>(type);
+    record.session = static_cast<uint32_t>(readVarint());
+    _timestamp += readVarint();
+    record.timestamp = _timestamp;
+    record.payload.resize(readVarint());
+    if (! _file.read(&record.payload[0], record.payload.size())) {
+      throw std::runtime_error("truncated capture record");
+    }
+    return true;
+  }
+
+private:
+  uint64_t readVarint() {
+    uint64_t value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+      int byte = _file.get();
+      if (byte == std::char_traits<char>::eof()) {
+	throw std::runtime_error("truncated capture record");
+      }
+      value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      if (! (byte & 0x80)) {
+	return value;
+      }
+    }
+    throw std::runtime_error("malformed varint in capture");
+  }
+
+  std::ifstream _file;
+  uint64_t _timestamp;
+};
+
+#endif
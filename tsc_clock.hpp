@@ -0,0 +1,233 @@
+#ifndef TSC_CLOCK_HPP
+#define TSC_CLOCK_HPP
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <ctime>
+#include <string>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <x86intrin.h>
+#endif
+
+// Nanosecond clock read from the invariant TSC: an rdtsc and a multiply instead of a
+// clock_gettime call. It is calibrated against CLOCK_MONOTONIC at startup and re-anchored
+// every RECALIBRATE_NS by whichever reader first notices the period is over, so the TSC's
+// rate error never accumulates. Each re-anchoring keeps the clock continuous and steers its
+// rate so that the remaining error is gone by the next one. The CLOCK_REALTIME offset is
+// sampled at the same points, so wall-clock readings pick up NTP steps within a period.
+//
+// Without an invariant TSC (or off x86) every read falls back to clock_gettime.
+class TscClock {
+public:
+  enum : uint64_t {
+    RECALIBRATE_NS = 1000000000
+  };
+
+  static TscClock& instance() {
+    static TscClock clock;
+    return clock;
+  }
+
+  bool usingTsc() const {
+    return _usingTsc;
+  }
+
+  // Monotonic nanoseconds, same epoch as CLOCK_MONOTONIC.
+  uint64_t now() {
+    if (! _usingTsc) {
+      return clockNs(CLOCK_MONOTONIC);
+    }
+    uint64_t tsc = ticks();
+    uint64_t ns;
+    uint64_t anchorTsc;
+    read(tsc, ns, anchorTsc);
+    // Signed: another core's TSC may read slightly behind the anchor's.
+    if (static_cast<int64_t>(tsc - anchorTsc) > static_cast<int64_t>(_recalibrateTicks)) {
+      recalibrate();
+    }
+    return ns;
+  }
+
+  // Nanoseconds since the Unix epoch.
+  uint64_t realtimeNow() {
+    if (! _usingTsc) {
+      return clockNs(CLOCK_REALTIME);
+    }
+    uint64_t ns = now();
+    return ns + _realtimeOffset.load(std::memory_order_relaxed);
+  }
+
+  static uint64_t ticks() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return 0;
+#endif
+  }
+
+private:
+  // Fixed point: ns = anchorNs + ((tsc - anchorTsc) * mult >> SHIFT).
+  enum {
+    SHIFT = 24
+  };
+
+  TscClock() :
+    _usingTsc(hasInvariantTsc()),
+    _sequence(0),
+    _anchorTsc(0),
+    _anchorNs(0),
+    _mult(0),
+    _recalibrateTicks(0),
+    _realtimeOffset(0),
+    _recalibrating(false),
+    _lastSampleTsc(0),
+    _lastSampleNs(0) {
+    if (! _usingTsc) {
+      return;
+    }
+    // Initial rate from a short busy interval; the first recalibration refines it.
+    uint64_t tsc0, ns0, tsc1, ns1;
+    sample(tsc0, ns0);
+    do {
+      sample(tsc1, ns1);
+    } while (ns1 - ns0 < 20000000);
+    uint64_t mult = ((ns1 - ns0) << SHIFT) / (tsc1 - tsc0);
+    _recalibrateTicks = (tsc1 - tsc0) * (RECALIBRATE_NS / (ns1 - ns0));
+    _realtimeOffset.store(clockNs(CLOCK_REALTIME) - clockNs(CLOCK_MONOTONIC), std::memory_order_relaxed);
+    _lastSampleTsc = tsc1;
+    _lastSampleNs = ns1;
+    publish(tsc1, ns1, mult);
+  }
+
+  static bool hasInvariantTsc() {
+#if defined(__x86_64__) || defined(__i386__)
+    unsigned eax, ebx, ecx, edx;
+    if (! __get_cpuid(0x80000000, &eax, &ebx, &ecx, &edx) || eax < 0x80000007) {
+      return false;
+    }
+    __get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx);
+    return edx & (1u << 8);
+#else
+    return false;
+#endif
+  }
+
+  static uint64_t clockNs(clockid_t clock) {
+    timespec ts;
+    clock_gettime(clock, &ts);
+    return uint64_t(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+  }
+
+  // TSC read bracketing the clock_gettime call, attributed to its midpoint.
+  static void sample(uint64_t& tsc, uint64_t& ns) {
+    uint64_t before = ticks();
+    ns = clockNs(CLOCK_MONOTONIC);
+    tsc = before + (ticks() - before) / 2;
+  }
+
+  // Seqlock: readers retry if a recalibration published new parameters meanwhile.
+  void read(uint64_t tsc, uint64_t& ns, uint64_t& anchorTsc) const {
+    while (true) {
+      uint32_t sequence = _sequence.load(std::memory_order_acquire);
+      if (sequence & 1) {
+	continue;
+      }
+      anchorTsc = _anchorTsc.load(std::memory_order_relaxed);
+      uint64_t anchorNs = _anchorNs.load(std::memory_order_relaxed);
+      uint64_t mult = _mult.load(std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (_sequence.load(std::memory_order_relaxed) == sequence) {
+	uint64_t elapsed = tsc > anchorTsc ? tsc - anchorTsc : 0;
+	ns = anchorNs + static_cast<uint64_t>((static_cast<unsigned __int128>(elapsed) * mult) >> SHIFT);
+	return;
+      }
+    }
+  }
+
+  void publish(uint64_t anchorTsc, uint64_t anchorNs, uint64_t mult) {
+    _sequence.fetch_add(1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    _anchorTsc.store(anchorTsc, std::memory_order_relaxed);
+    _anchorNs.store(anchorNs, std::memory_order_relaxed);
+    _mult.store(mult, std::memory_order_relaxed);
+    _sequence.fetch_add(1, std::memory_order_release);
+  }
+
+  void recalibrate() {
+    if (_recalibrating.exchange(true, std::memory_order_acquire)) {
+      return;
+    }
+    uint64_t sampleTsc, actual, predicted, anchorTsc;
+    sample(sampleTsc, actual);
+    read(sampleTsc, predicted, anchorTsc);
+
+    // The TSC rate measured over the last period, corrected so that the clock, continuing
+    // from its current reading, meets CLOCK_MONOTONIC one period from now. The correction is
+    // clamped to 1%: the clock never jumps, let alone runs backwards.
+    double rate = double(actual - _lastSampleNs) / double(sampleTsc - _lastSampleTsc);
+    double correction = double(int64_t(actual - predicted)) / (rate * _recalibrateTicks);
+    correction = std::max(-0.01, std::min(0.01, correction));
+    uint64_t mult = static_cast<uint64_t>(rate * (1.0 + correction) * (1 << SHIFT));
+
+    _lastSampleTsc = sampleTsc;
+    _lastSampleNs = actual;
+    _realtimeOffset.store(clockNs(CLOCK_REALTIME) - clockNs(CLOCK_MONOTONIC), std::memory_order_relaxed);
+    publish(sampleTsc, predicted, mult);
+    _recalibrating.store(false, std::memory_order_release);
+  }
+
+  const bool _usingTsc;
+  std::atomic<uint32_t> _sequence;
+  std::atomic<uint64_t> _anchorTsc;
+  std::atomic<uint64_t> _anchorNs;
+  std::atomic<uint64_t> _mult;
+  uint64_t _recalibrateTicks;
+  std::atomic<uint64_t> _realtimeOffset;
+  std::atomic<bool> _recalibrating;
+  uint64_t _lastSampleTsc;  // only touched by the recalibrating thread
+  uint64_t _lastSampleNs;
+};
+
+// std::chrono clock on top of TscClock, usable wherever steady_clock is.
+struct TscSteadyClock {
+  typedef std::chrono::nanoseconds duration;
+  typedef duration::rep rep;
+  typedef duration::period period;
+  typedef std::chrono::time_point<TscSteadyClock> time_point;
+  static constexpr bool is_steady = true;
+
+  static time_point now() {
+    return time_point(duration(TscClock::instance().now()));
+  }
+};
+
+static const size_t LOCAL_TIMESTAMP_SIZE = 27;
+
+// Appends "2024-Jan-02 13:45:06.123456" in local time, the format boost::posix_time prints.
+// The part up to the seconds is formatted once per second and per thread.
+inline void appendLocalTimestamp(std::string& out, uint64_t realtimeNs) {
+  static thread_local time_t cachedSecond = -1;
+  static thread_local char cached[32];
+  static const char* const months[] = {
+    "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+  };
+  time_t second = static_cast<time_t>(realtimeNs / 1000000000);
+  if (second != cachedSecond) {
+    tm local;
+    localtime_r(&second, &local);
+    std::snprintf(cached, sizeof(cached), "%04d-%s-%02d %02d:%02d:%02d", local.tm_year + 1900,
+		  months[local.tm_mon], local.tm_mday, local.tm_hour, local.tm_min, local.tm_sec);
+    cachedSecond = second;
+  }
+  char micros[8];
+  std::snprintf(micros, sizeof(micros), ".%06u", static_cast<unsigned>(realtimeNs / 1000 % 1000000));
+  out += cached;
+  out += micros;
+}
+
+#endif
@@ -0,0 +1,67 @@
+#ifndef UNIX_LISTENER_HPP
+#define UNIX_LISTENER_HPP
+
+#include <boost/asio.hpp>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+
+// Session sockets are generic stream sockets, so the same ClientSession can be fed by
+// the TCP acceptor and by the Unix domain one.
+typedef boost::asio::generic::stream_protocol::socket StreamSocket;
+
+// "@name" selects the Linux abstract namespace (no file, vanishes with the last descriptor),
+// anything else is a filesystem path.
+inline boost::asio::local::stream_protocol::endpoint makeUnixEndpoint(const std::string& path) {
+  if (! path.empty() && path[0] == '@') {
+    return boost::asio::local::stream_protocol::endpoint(std::string(1, '\0') + path.substr(1));
+  }
+  return boost::asio::local::stream_protocol::endpoint(path);
+}
+
+// Removes a socket file left by a server that has gone: only a socket nobody accepts on. Any
+// other file, or a socket a running server still listens on, is an error rather than taken over.
+inline void removeStaleUnixSocket(const std::string& path) {
+  struct stat status;
+  if (::lstat(path.c_str(), &status) != 0) {
+    if (errno == ENOENT) {
+      return;
+    }
+    throw std::system_error(errno, std::system_category(), "lstat " + path);
+  }
+  if (! S_ISSOCK(status.st_mode)) {
+    throw std::runtime_error(path + " exists and is not a socket");
+  }
+  boost::asio::io_service ioService;
+  boost::asio::local::stream_protocol::socket probe(ioService);
+  boost::system::error_code ec;
+  probe.connect(boost::asio::local::stream_protocol::endpoint(path), ec);
+  if (! ec) {
+    throw std::runtime_error("another server is listening on " + path);
+  }
+  if (ec != boost::asio::error::connection_refused) {
+    throw boost::system::system_error(ec, "connect " + path);
+  }
+  if (::unlink(path.c_str()) != 0) {
+    throw std::system_error(errno, std::system_category(), "unlink " + path);
+  }
+}
+
+// Binds a listening Unix socket, replacing a stale socket file left by a previous run.
+inline void openUnixAcceptor(boost::asio::local::stream_protocol::acceptor& acceptor,
+			     const std::string& path) {
+  if (! path.empty() && path[0] != '@') {
+    removeStaleUnixSocket(path);
+  }
+  auto endpoint = makeUnixEndpoint(path);
+  acceptor.open(endpoint.protocol());
+  acceptor.bind(endpoint);
+  acceptor.listen();
+}
+
+#endif
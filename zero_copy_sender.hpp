@@ -0,0 +1,164 @@
+#ifndef ZERO_COPY_SENDER_HPP
+#define ZERO_COPY_SENDER_HPP
+
+#include <linux/errqueue.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+
+#include <cerrno>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <system_error>
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+
+// MSG_ZEROCOPY sends of shared message bodies on one blocking TCP socket. The kernel pins the
+// pages of the body instead of copying them into the send buffer, and reports on the socket's
+// error queue, by the sequence number of each send call, once it no longer needs them; until
+// then the sender holds a reference to the body, so broadcasting one immutable string to many
+// sockets never copies it in user space nor frees it under the kernel. Pinning and the
+// notifications cost more than copying small buffers, so this is only worth it for bodies of
+// some ten kilobytes up. Over loopback the kernel copies anyway when the data is delivered,
+// and says so in the notification (counted in kernelCopies()).
+//
+// Used by one writer thread; throws std::system_error when the socket fails.
+class ZeroCopySender {
+public:
+  enum {
+    DRAIN_TIMEOUT_MS = 1000
+  };
+
+  // Turns on SO_ZEROCOPY; sockets that don't support it (Unix domain ones, old kernels) leave
+  // the sender disabled.
+  explicit ZeroCopySender(int fd) :
+    _fd(fd),
+    _nextId(0),
+    _sends(0),
+    _kernelCopies(0) {
+    int one = 1;
+    _enabled = setsockopt(fd, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) == 0;
+  }
+
+  ZeroCopySender(const ZeroCopySender&) = delete;
+  ZeroCopySender& operator=(const ZeroCopySender&) = delete;
+
+  bool enabled() const {
+    return _enabled;
+  }
+
+  // Sends all of *body. If the kernel runs out of memory for tracking pinned pages (ENOBUFS),
+  // the rest of the body goes out as an ordinary copying send.
+  void send(const std::shared_ptr<std::string>& body) {
+    const char* data = body->data();
+    size_t left = body->size();
+    while (left) {
+      ssize_t sent = ::send(_fd, data, left, MSG_ZEROCOPY | MSG_NOSIGNAL);
+      if (sent >= 0) {
+	// Every successful zero-copy call takes the next sequence number.
+	_pending.push_back(body);
+	++_nextId;
+	++_sends;
+      }
+      else if (errno == ENOBUFS) {
+	reap(0);
+	sent = ::send(_fd, data, left, MSG_NOSIGNAL);
+      }
+      if (sent < 0) {
+	if (errno == EINTR || errno == ENOBUFS) {
+	  continue;
+	}
+	throw std::system_error(errno, std::system_category(), "send");
+      }
+      data += sent;
+      left -= sent;
+    }
+    reap(0);
+  }
+
+  // Before the socket closes, after which no more notifications arrive: waits a bounded time
+  // for the outstanding ones, so the counters are complete.
+  void drain() {
+    try {
+      reap(DRAIN_TIMEOUT_MS);
+    }
+    catch (std::exception&) { }
+  }
+
+  // Zero-copy send calls made, and how many of those the kernel copied after all.
+  uint64_t sends() const {
+    return _sends;
+  }
+
+  uint64_t kernelCopies() const {
+    return _kernelCopies;
+  }
+
+private:
+  // Drops the references for every completed send, waiting up to timeoutMs for notifications
+  // while any are outstanding.
+  void reap(int timeoutMs) {
+    while (! _pending.empty()) {
+      char control[128];
+      msghdr msg = {};
+      msg.msg_control = control;
+      msg.msg_controllen = sizeof(control);
+      if (recvmsg(_fd, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0) {
+	if (errno == EINTR) {
+	  continue;
+	}
+	if (errno != EAGAIN && errno != EWOULDBLOCK) {
+	  throw std::system_error(errno, std::system_category(), "recvmsg(MSG_ERRQUEUE)");
+	}
+	pollfd pfd = { _fd, 0, 0 };  // POLLERR is always reported
+	if (timeoutMs == 0 || poll(&pfd, 1, timeoutMs) <= 0) {
+	  return;
+	}
+	continue;
+      }
+      for (cmsghdr* cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+	if (! ((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) ||
+	       (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))) {
+	  continue;
+	}
+	const sock_extended_err* error = reinterpret_cast<const sock_extended_err*>(CMSG_DATA(cmsg));
+	if (error->ee_origin == SO_EE_ORIGIN_ZEROCOPY && error->ee_errno == 0) {
+	  complete(error->ee_info, error->ee_data, error->ee_code & SO_EE_CODE_ZEROCOPY_COPIED);
+	}
+      }
+    }
+  }
+
+  // Notifications cover ranges of sequence numbers and may come out of order; _pending holds
+  // one entry per outstanding number, the newest at the back, so entries are cleared in place
+  // and trimmed from the front.
+  void complete(uint32_t first, uint32_t last, bool copied) {
+    uint32_t oldest = _nextId - static_cast<uint32_t>(_pending.size());
+    for (uint32_t id = first; id - first <= last - first; ++id) {
+      uint32_t index = id - oldest;
+      if (index < _pending.size() && _pending[index]) {
+	_pending[index].reset();
+	_kernelCopies += copied;
+      }
+    }
+    while (! _pending.empty() && ! _pending.front()) {
+      _pending.pop_front();
+    }
+  }
+
+  const int _fd;
+  bool _enabled;
+  uint32_t _nextId;
+  std::deque<std::shared_ptr<std::string> > _pending;
+  uint64_t _sends;
+  uint64_t _kernelCopies;
+};
+
+#endif